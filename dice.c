@@ -12,15 +12,229 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <math.h>
+#include <stdarg.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+// The batch evaluator and the input scanner have AVX2 paths, chosen at run time, on x86 with GCC or Clang.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_AVX2)
+#define USING_AVX2_BATCH
+#include <immintrin.h>
+#endif
+
+// Where emit() writes on this thread: an in-memory buffer if one is installed, otherwise stdout.
+static THREAD_LOCAL OutputBuffer* output_sink = NULL;
+
+/** Writes formatted program output to this thread's output sink (see set_output_sink). */
+void emit(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  if (output_sink == NULL) {
+    vprintf(format, args);
+    va_end(args);
+    return;
+  }
+  va_list retry;
+  va_copy(retry, args);
+  OutputBuffer* out = output_sink;
+  int needed = vsnprintf(out->data + out->len, out->cap - out->len, format, args);
+  if (needed >= 0 && out->len + needed + 1 > out->cap) {
+    size_t cap = out->cap ? out->cap : 256;
+    while (cap < out->len + needed + 1) {
+      cap *= 2;
+    }
+    char* grown = realloc(out->data, cap);
+    if (grown == NULL) {
+      va_end(retry);
+      va_end(args);
+      return;
+    }
+    out->data = grown;
+    out->cap = cap;
+    needed = vsnprintf(out->data + out->len, out->cap - out->len, format, retry);
+  }
+  if (needed > 0) {
+    out->len += needed;
+  }
+  va_end(retry);
+  va_end(args);
+}
+
+/** Redirects this thread's emit() and print_error() output into 'sink' (or back to stdout, if NULL). */
+void set_output_sink(OutputBuffer* sink) {
+  output_sink = sink;
+}
 
 void print_error(char* message) {
-  printf("ERROR: %s\n", message);
+  emit("ERROR: %s\n", message);
+}
+
+#ifdef USING_TRACE
+#ifdef _WIN32
+#error "Span tracing (USING_TRACE) is only supported on POSIX builds."
+#endif
+
+bool trace_enabled = false;
+static char* trace_path = NULL;
+static TraceRing* trace_rings = NULL;
+static int trace_ring_count = 0;
+static THREAD_LOCAL TraceRing* trace_ring = NULL;
+
+/** Reads the clock used to timestamp spans, in nanoseconds. It is monotonic, so span durations are
+ *  unaffected by changes to the wall clock. */
+long long trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Allocates this thread's ring buffer and links it into the list dumped at exit. */
+static TraceRing* trace_register_thread() {
+  TraceRing* ring = calloc(1, sizeof(TraceRing));
+  if (ring == NULL) {
+    trace_enabled = false;
+    print_error("Out of memory (tracing disabled).");
+    return NULL;
+  }
+  ring->tid = __sync_add_and_fetch(&trace_ring_count, 1);
+  do {
+    ring->next = trace_rings;
+  } while (!__sync_bool_compare_and_swap(&trace_rings, ring->next, ring));
+  trace_ring = ring;
+  return ring;
+}
+
+/** Records a completed span that started at 'start' and ends now. */
+void trace_record(const char* name, long long start) {
+  TraceRing* ring = trace_ring;
+  if (ring == NULL && (ring = trace_register_thread()) == NULL) {
+    return;
+  }
+  TraceEvent* ev = &ring->events[ring->count % TRACE_RING_SIZE];
+  ev->name = name;
+  ev->start = start;
+  ev->end = trace_now();
+  ring->count++;
+}
+
+/** Writes every thread's retained spans to the -trace file as Chrome trace-event JSON. */
+static void trace_dump() {
+  trace_enabled = false;
+  FILE* out = fopen(trace_path, "w");
+  if (out == NULL) {
+    print_error("Could not open trace output file.");
+    return;
+  }
+  long long origin = -1;
+  for (TraceRing* ring = trace_rings; ring != NULL; ring = ring->next) {
+    unsigned long long first = ring->count > TRACE_RING_SIZE ? ring->count - TRACE_RING_SIZE : 0;
+    if (ring->count > first && (origin < 0 || ring->events[first % TRACE_RING_SIZE].start < origin)) {
+      origin = ring->events[first % TRACE_RING_SIZE].start;
+    }
+  }
+  fprintf(out, "{\"traceEvents\":[\n");
+  bool first_event = true;
+  for (TraceRing* ring = trace_rings; ring != NULL; ring = ring->next) {
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"dice-%d\"}}",
+            first_event ? "" : ",\n", ring->tid, ring->tid);
+    first_event = false;
+    unsigned long long first = ring->count > TRACE_RING_SIZE ? ring->count - TRACE_RING_SIZE : 0;
+    for (unsigned long long i = first; i < ring->count; i++) {
+      TraceEvent* ev = &ring->events[i % TRACE_RING_SIZE];
+      fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"dice\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+              ev->name, ring->tid, (ev->start - origin) / 1000.0, (ev->end - ev->start) / 1000.0);
+    }
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  fclose(out);
+}
+
+/** Turns on span recording; the collected spans are written to 'path' when the program exits. */
+void trace_start(char* path) {
+  trace_path = path;
+  trace_enabled = true;
+  atexit(trace_dump);
+}
+#else
+void trace_start(char* path) {
+  (void) path;
+  print_error("This build does not include tracing (rebuild with 'make trace'); ignoring -trace.");
+}
+#endif
+
+// The generator that get_next_random() draws from on this thread, if a simulation has installed one.
+static THREAD_LOCAL RandomState* active_random = NULL;
+
+/** Advances a splitmix64 sequence; used to expand a 64-bit seed into generator state. */
+static uint64_t splitmix64_next(uint64_t* x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+/** Seeds a xoshiro256** generator deterministically from a 64-bit seed. */
+void random_state_seed(RandomState* state, uint64_t seed) {
+  for (int i = 0; i < 4; i++) {
+    state->s[i] = splitmix64_next(&seed);
+  }
+}
+
+/** Returns the next 64 bits from a xoshiro256** generator. */
+uint64_t random_state_next(RandomState* state) {
+  uint64_t* s = state->s;
+  uint64_t result = rotl64(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl64(s[3], 45);
+  return result;
+}
+
+/** Advances a generator by 2^128 draws, giving a stream that cannot overlap the one it was jumped from. */
+void random_state_jump(RandomState* state) {
+  static const uint64_t JUMP[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (int i = 0; i < 4; i++) {
+    for (int b = 0; b < 64; b++) {
+      if (JUMP[i] & (1ULL << b)) {
+        s0 ^= state->s[0];
+        s1 ^= state->s[1];
+        s2 ^= state->s[2];
+        s3 ^= state->s[3];
+      }
+      random_state_next(state);
+    }
+  }
+  state->s[0] = s0;
+  state->s[1] = s1;
+  state->s[2] = s2;
+  state->s[3] = s3;
+}
+
+/** Makes get_next_random() on this thread draw from 'state' (or from the system generator again, if NULL). */
+void set_active_random(RandomState* state) {
+  active_random = state;
 }
 
 /** Initializes the random generator. Should be called once per program invocation.
  *  Currently using the random device to seed, freeing it from macro-scale time
  *  dependencies from the previous approach. */
 void init_random() {
+  TRACE_BEGIN(t);
 #ifndef _WIN32
 #ifndef USING_FALLBACK_RANDOM
   srandomdev();
@@ -28,11 +242,16 @@ void init_random() {
   srand(time(NULL));
 #endif
 #endif
+  TRACE_END(t, "init_random");
 }
 
 /** Gets a random number from the generator. Using BSD random() currently to go with
  *  srandomdev in init_random. Windows uses rand_s which has better performance than rand.*/
 int get_next_random() {
+  if (active_random != NULL) {
+    // Keep the same 31-bit range as random() so results are interchangeable.
+    return (int) (random_state_next(active_random) >> 33);
+  }
 #ifdef _WIN32
   unsigned int num;
   errno_t e = rand_s(&num);
@@ -42,14 +261,85 @@ int get_next_random() {
   }
   // rand_s can return negative numbers when cast to int; so convert after casting
   int snum = (int) num;
-  return snum < 0 ? snum*-1 : snum;
+  int result = snum < 0 ? snum*-1 : snum;
 #else
 #ifndef USING_FALLBACK_RANDOM
-  return (int) random();
+  int result = (int) random();
 #else
-  return rand();
+  int result = rand();
 #endif
 #endif
+  return result;
+}
+
+// The number of distinct values get_next_random() can return, for scaling to the unit interval.
+#if !defined(_WIN32) && defined(USING_FALLBACK_RANDOM)
+#define RANDOM_RANGE ((double) RAND_MAX + 1.0)
+#else
+#define RANDOM_RANGE 2147483648.0
+#endif
+
+/** Gets a random number from the generator scaled into the open interval (0, 1). */
+double get_next_random_unit() {
+  if (active_random != NULL) {
+    return ((random_state_next(active_random) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+  }
+  double u = (get_next_random() + 0.5) / RANDOM_RANGE;
+  return u < 1.0 ? u : 1.0 - 0.5 / RANDOM_RANGE;
+}
+
+/** Samples the number of successes in n trials of probability p. Small means are sampled by
+ *  inversion; larger ones use Hormann's BTRS transformed rejection, which takes a constant
+ *  expected number of draws regardless of n. */
+int sample_binomial(int n, double p) {
+  if (n <= 0 || p <= 0.0) {
+    return 0;
+  }
+  if (p >= 1.0) {
+    return n;
+  }
+  if (p > 0.5) {
+    return n - sample_binomial(n, 1.0 - p);
+  }
+  double q = 1.0 - p;
+  if (n * p < 10.0) {
+    double s = p / q;
+    double a = (n + 1) * s;
+    double r = pow(q, n);
+    double u = get_next_random_unit();
+    int x = 0;
+    while (u > r && x < n) {
+      u -= r;
+      x++;
+      r *= (a / x) - s;
+    }
+    return x;
+  }
+  double spq = sqrt(n * p * q);
+  double b = 1.15 + 2.53 * spq;
+  double a = -0.0873 + 0.0248 * b + 0.01 * p;
+  double c = n * p + 0.5;
+  double vr = 0.92 - 4.2 / b;
+  double alpha = (2.83 + 5.1 / b) * spq;
+  double lpq = log(p / q);
+  double m = floor((n + 1) * p);
+  double h = lgamma(m + 1) + lgamma(n - m + 1);
+  for (;;) {
+    double u = get_next_random_unit() - 0.5;
+    double v = get_next_random_unit();
+    double us = 0.5 - fabs(u);
+    double k = floor((2 * a / us + b) * u + c);
+    if (k < 0 || k > n) {
+      continue;
+    }
+    if (us >= 0.07 && v <= vr) {
+      return (int) k;
+    }
+    v = log(v * alpha / (a / (us * us) + b));
+    if (v <= h - lgamma(k + 1) - lgamma(n - k + 1) + (k - m) * lpq) {
+      return (int) k;
+    }
+  }
 }
 
 /** Frees a modifier node in the parse tree. Safe to call on null references. */
@@ -86,8 +376,326 @@ void free_expr_node(ExprList* list) {
   }
 }
 
+/** Returns true iff the CPU can run the AVX2 paths. This is called from every stream worker, so it
+ *  keeps no state of its own: the runtime fills in the CPU model before main and this only reads it. */
+bool cpu_has_avx2() {
+#if defined(USING_AVX2_BATCH)
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+/** Returns the index of the lowest set bit of a non-zero mask. */
+static inline int lowest_bit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(mask);
+#else
+  int i = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    i++;
+  }
+  return i;
+#endif
+}
+
+/** Returns the number of set bits in a mask. */
+static inline int count_bits(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(mask);
+#else
+  int n = 0;
+  for (; mask; mask &= mask - 1) {
+    n++;
+  }
+  return n;
+#endif
+}
+
+// The class of every byte for the scalar scanner, as an index into its masks (0 for none).
+static const uint8_t scan_classes[256] = {
+  ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+  ['+'] = 2, ['-'] = 2, ['*'] = 3, ['/'] = 3, ['('] = 4, [')'] = 5, [' '] = 6, ['\n'] = 7, ['\0'] = 8,
+  ['d'] = 9, ['c'] = 9, ['b'] = 9, ['v'] = 9, ['w'] = 9, ['s'] = 9, ['e'] = 9, ['f'] = 9
+};
+
+/** Classifies one block of SCAN_BLOCK_BYTES bytes a byte at a time. */
+void scan_block_scalar(const unsigned char* data, ScanBlock* block) {
+  uint64_t masks[10] = { 0 };
+  for (int i = 0; i < SCAN_BLOCK_BYTES; i++) {
+    masks[scan_classes[data[i]]] |= 1ULL << i;
+  }
+  block->digit = masks[1];
+  block->add_op = masks[2];
+  block->mul_op = masks[3];
+  block->open = masks[4];
+  block->close = masks[5];
+  block->space = masks[6];
+  block->newline = masks[7];
+  block->nul = masks[8];
+  block->letter = masks[9];
+}
+
+#ifdef USING_AVX2_BATCH
+/** Classifies one block of SCAN_BLOCK_BYTES bytes 32 at a time. As in simdjson, each byte's low and high
+ *  nibbles are looked up in two 16-entry tables of class bits and the results ANDed; every class has a
+ *  single high nibble, so this is exact. The letters need a second pair of tables. */
+__attribute__((target("avx2")))
+void scan_block_avx2(const unsigned char* data, ScanBlock* block) {
+  const char d = SCAN_DIGIT, l0 = (char) (SCAN_DIGIT | SCAN_SPACE | SCAN_NUL), l8 = SCAN_DIGIT | SCAN_OPEN,
+             l9 = SCAN_DIGIT | SCAN_CLOSE, lA = SCAN_MUL_OP | SCAN_NEWLINE, a = SCAN_ADD_OP, m = SCAN_MUL_OP;
+  const char h0 = (char) (SCAN_NEWLINE | SCAN_NUL), h2 = SCAN_ADD_OP | SCAN_MUL_OP | SCAN_OPEN | SCAN_CLOSE | SCAN_SPACE;
+  const __m256i low_classes = _mm256_setr_epi8(l0, d, d, d, d, d, d, d, l8, l9, lA, a, 0, a, 0, m,
+                                               l0, d, d, d, d, d, d, d, l8, l9, lA, a, 0, a, 0, m);
+  const __m256i high_classes = _mm256_setr_epi8(h0, 0, h2, d, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                h0, 0, h2, d, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  // Letters: b c d e f are 0x62-0x66 (bit 0), s v w are 0x73, 0x76, 0x77 (bit 1).
+  const __m256i low_letters = _mm256_setr_epi8(
+    0, 0, 1, 3, 1, 1, 3, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 3, 1, 1, 3, 2, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i high_letters = _mm256_setr_epi8(
+    0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i zero = _mm256_setzero_si256();
+  uint64_t masks[9] = { 0 };
+  for (int half = 0; half < 2; half++) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*) (data + 32 * half));
+    __m256i low = _mm256_and_si256(bytes, nibble);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+    __m256i classes = _mm256_and_si256(_mm256_shuffle_epi8(low_classes, low), _mm256_shuffle_epi8(high_classes, high));
+    __m256i letters = _mm256_and_si256(_mm256_shuffle_epi8(low_letters, low), _mm256_shuffle_epi8(high_letters, high));
+    for (int c = 0; c < 8; c++) {
+      // Shift class bit c up to each byte's top bit, which is what movemask collects.
+      masks[c] |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16(classes, 7 - c)) << (32 * half);
+    }
+    masks[8] |= (uint64_t) (uint32_t) ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(letters, zero)) << (32 * half);
+  }
+  block->digit = masks[0];
+  block->add_op = masks[1];
+  block->mul_op = masks[2];
+  block->open = masks[3];
+  block->close = masks[4];
+  block->space = masks[5];
+  block->newline = masks[6];
+  block->nul = masks[7];
+  block->letter = masks[8];
+}
+#endif
+
+/** Classifies 'len' bytes of input into an index (reusing its storage), and works out the parenthesis
+ *  depth at the start of each block from the counts of its parentheses. The index refers to 'data', which must outlive it. Uses AVX2 when
+ *  the CPU has it, and otherwise (or when 'scalar' is set) classifies a byte at a time. */
+bool scan_index_build_with(ScanIndex* index, const char* data, size_t len, bool scalar) {
+  size_t count = (len + SCAN_BLOCK_BYTES - 1) / SCAN_BLOCK_BYTES;
+  if (count > index->cap) {
+    ScanBlock* grown = realloc(index->blocks, sizeof(ScanBlock) * count);
+    if (grown == NULL) {
+      print_error("Out of memory.");
+      return false;
+    }
+    index->blocks = grown;
+    index->cap = count;
+  }
+  index->base = data;
+  index->len = len;
+  index->block_count = count;
+  void (*classify)(const unsigned char*, ScanBlock*) = scan_block_scalar;
+#ifdef USING_AVX2_BATCH
+  if (!scalar && cpu_has_avx2()) {
+    classify = scan_block_avx2;
+  }
+#else
+  (void) scalar;
+#endif
+  int64_t depth = 0;
+  for (size_t b = 0; b < count; b++) {
+    ScanBlock* block = &index->blocks[b];
+    size_t offset = b * SCAN_BLOCK_BYTES;
+    if (len - offset >= SCAN_BLOCK_BYTES) {
+      classify((const unsigned char*) data + offset, block);
+    } else {
+      // The last, partial block is classified from a copy and its bits past the end cleared.
+      unsigned char tail[SCAN_BLOCK_BYTES] = { 0 };
+      memcpy(tail, data + offset, len - offset);
+      classify(tail, block);
+      uint64_t keep = (1ULL << (len - offset)) - 1;
+      block->digit &= keep;
+      block->add_op &= keep;
+      block->mul_op &= keep;
+      block->open &= keep;
+      block->close &= keep;
+      block->space &= keep;
+      block->newline &= keep;
+      block->nul &= keep;
+      block->letter &= keep;
+    }
+    block->depth = depth;
+    depth += count_bits(block->open) - count_bits(block->close);
+  }
+  index->end_depth = depth;
+  return true;
+}
+
+/** Builds an index of 'len' bytes of input; see scan_index_build_with. */
+bool scan_index_build(ScanIndex* index, const char* data, size_t len) {
+  return scan_index_build_with(index, data, len, false);
+}
+
+/** Frees the storage held by an index. */
+void scan_index_free(ScanIndex* index) {
+  free(index->blocks);
+  memset(index, 0, sizeof(ScanIndex));
+}
+
+// The index of the input being parsed on this thread, if any (see set_scan_index).
+static THREAD_LOCAL ScanIndex* scan_index = NULL;
+
+/** Makes the parser on this thread use 'index' for any input inside the buffer it covers (or stop, if NULL). */
+void set_scan_index(ScanIndex* index) {
+  scan_index = index;
+}
+
+/** Returns true iff this thread's scan index covers [text, text + len). */
+static inline bool scan_index_covers(const char* text, size_t len) {
+  return scan_index != NULL && text >= scan_index->base && text + len <= scan_index->base + scan_index->len;
+}
+
+/** Returns the bits of block b that lie within the byte range [start, end). */
+static inline uint64_t scan_range_mask(size_t b, size_t start, size_t end) {
+  size_t first = b * SCAN_BLOCK_BYTES;
+  size_t lo = start > first ? start - first : 0;
+  size_t hi = end - first < SCAN_BLOCK_BYTES ? end - first : SCAN_BLOCK_BYTES;
+  uint64_t below_hi = (hi == SCAN_BLOCK_BYTES) ? ~0ULL : (1ULL << hi) - 1;
+  return below_hi & ~((1ULL << lo) - 1);
+}
+
+/** Returns the length of the token starting at 'text': the bytes before the next space, newline or NUL
+ *  (as strcspn(text, " \n") would). */
+int token_length(const char* text) {
+  if (!scan_index_covers(text, 1)) {
+    return strcspn(text, " \n");
+  }
+  size_t start = text - scan_index->base;
+  for (size_t b = start / SCAN_BLOCK_BYTES; b < scan_index->block_count; b++) {
+    ScanBlock* block = &scan_index->blocks[b];
+    uint64_t ends = (block->space | block->newline | block->nul) & scan_range_mask(b, start, scan_index->len);
+    if (ends) {
+      return (int) (b * SCAN_BLOCK_BYTES + lowest_bit(ends) - start);
+    }
+  }
+  int indexed = (int) (scan_index->len - start);
+  return indexed + (int) strcspn(text + indexed, " \n");
+}
+
+/** Returns the length of the NUL-terminated line starting at 'text' (as strlen would). */
+size_t line_length(const char* text) {
+  if (!scan_index_covers(text, 1)) {
+    return strlen(text);
+  }
+  size_t start = text - scan_index->base;
+  for (size_t b = start / SCAN_BLOCK_BYTES; b < scan_index->block_count; b++) {
+    uint64_t nul = scan_index->blocks[b].nul & scan_range_mask(b, start, scan_index->len);
+    if (nul) {
+      return b * SCAN_BLOCK_BYTES + lowest_bit(nul) - start;
+    }
+  }
+  size_t indexed = scan_index->len - start;
+  return indexed + strlen(text + indexed);
+}
+
+/** Returns true iff the len bytes at 'text' are all digits and are not followed by another digit
+ *  (as strspn(text, "0123456789") == len would). */
+bool span_is_digits(const char* text, int len) {
+  if (!scan_index_covers(text, len + 1)) {
+    return (int) strspn(text, "0123456789") == len;
+  }
+  size_t start = text - scan_index->base;
+  size_t end = start + len;
+  for (size_t b = start / SCAN_BLOCK_BYTES; b * SCAN_BLOCK_BYTES < end; b++) {
+    uint64_t range = scan_range_mask(b, start, end);
+    if ((scan_index->blocks[b].digit & range) != range) {
+      return false;
+    }
+  }
+  return !(scan_index->blocks[end / SCAN_BLOCK_BYTES].digit >> (end % SCAN_BLOCK_BYTES) & 1);
+}
+
+/** Returns the first of the roll letters 'letters' (some of d, c, b, v, w, s, e, f) among the len bytes
+ *  at 'text', or NULL if there is none. Indexed input is searched through its letter masks. */
+char* find_roll_letter(char* text, int len, const char* letters) {
+  if (!scan_index_covers(text, len)) {
+    for (int i = 0; i < len; i++) {
+      if (text[i] != '\0' && strchr(letters, text[i])) {
+        return text + i;
+      }
+    }
+    return NULL;
+  }
+  size_t start = text - scan_index->base;
+  size_t end = start + len;
+  for (size_t b = start / SCAN_BLOCK_BYTES; b * SCAN_BLOCK_BYTES < end; b++) {
+    for (uint64_t bits = scan_index->blocks[b].letter & scan_range_mask(b, start, end); bits; bits &= bits - 1) {
+      char* c = (char*) scan_index->base + b * SCAN_BLOCK_BYTES + lowest_bit(bits);
+      if (strchr(letters, *c)) {
+        return c;
+      }
+    }
+  }
+  return NULL;
+}
+
+/** find_first_free_opt over indexed input. Whole blocks are handled with a few bit operations: one with
+ *  no parentheses either holds the answer at its lowest operator bit or is skipped, as is one with no
+ *  operators and too few closing parentheses to take the depth below zero. Only blocks that mix the two are walked,
+ *  one parenthesis or operator at a time. */
+char* find_first_free_opt_indexed(char* inp, int len, bool mul) {
+  size_t start = inp - scan_index->base;
+  size_t end = start + len;
+  int64_t depth = 0;
+  for (size_t b = start / SCAN_BLOCK_BYTES; b * SCAN_BLOCK_BYTES < end; b++) {
+    ScanBlock* block = &scan_index->blocks[b];
+    uint64_t range = scan_range_mask(b, start, end);
+    uint64_t ops = (mul ? block->mul_op : block->add_op) & range;
+    uint64_t open = block->open & range;
+    uint64_t close = block->close & range;
+    if ((open | close) == 0) {
+      if (depth == 0 && ops) {
+        return inp + (b * SCAN_BLOCK_BYTES + lowest_bit(ops) - start);
+      }
+      continue;
+    }
+    if (ops == 0 && range == ~0ULL && depth >= count_bits(close)) {
+      // Too few closing parentheses to unbalance the expression: take the block's change in depth in bulk.
+      depth += ((b + 1 < scan_index->block_count) ? scan_index->blocks[b + 1].depth : scan_index->end_depth) - block->depth;
+      continue;
+    }
+    for (uint64_t bits = ops | open | close; bits; bits &= bits - 1) {
+      uint64_t bit = bits & -bits;
+      if (open & bit) {
+        depth++;
+      } else if (close & bit) {
+        depth--;
+        if (depth < 0) {
+          print_error("Mismatched parentheses.");
+          return "?";
+        }
+      } else if (depth == 0) {
+        return inp + (b * SCAN_BLOCK_BYTES + lowest_bit(bit) - start);
+      }
+    }
+  }
+  if (depth != 0) {
+    print_error("Mismatched parentheses.");
+    return "?";
+  }
+  return NULL;
+}
+
 /** Locates the first operator not nested within a deeper expression in the selected substring of input. */
 char* find_first_free_opt(char* inp, int len, char* opchars) {
+  if (scan_index_covers(inp, len)) {
+    return find_first_free_opt_indexed(inp, len, strchr(opchars, '*') != NULL);
+  }
   int parensDepth = 0;
   char* scan = strpbrk(inp, opchars);
   while (scan && ((scan - inp) < len)) {
@@ -118,6 +726,14 @@ char* find_first_free_opt(char* inp, int len, char* opchars) {
    Len should be the length of the string the expr_list should be concerned 
    with, i.e. either strlen(inp) or (strchr(inp, ')') - inp). */
 ExprList* parse_expr(char* inp, int len, OpType type) {
+  TRACE_BEGIN(t);
+  ExprList* expr = parse_expr_list(inp, len, type);
+  TRACE_END(t, "parse_expr");
+  return expr;
+}
+
+/** The body of parse_expr; see above. */
+ExprList* parse_expr_list(char* inp, int len, OpType type) {
   if (len <= 0) {
     print_error("Missing Object.");
     return NULL;
@@ -130,6 +746,10 @@ ExprList* parse_expr(char* inp, int len, OpType type) {
 
   //Is there an operator? If so, form is obj opt expr_list, if not just obj
   char* first_opt = find_first_free_opt(inp, len, opchars);
+  if (first_opt != NULL && *first_opt == '?') {
+    //Mismatched parentheses, already reported.
+    return NULL;
+  }
 
   if (first_opt) {
     ObjNode* obj = NULL;
@@ -216,8 +836,9 @@ ObjNode* parse_obj(char* inp, int len) {
     this_obj->roll = NULL;
     this_obj->constant = 0;
     this_obj->subList = subExpr;
+    this_obj->macro = -1;
     return this_obj;
-  } else if (strspn(inp, "0123456789") == len) {
+  } else if (span_is_digits(inp, len)) {
     //It is a constant.
     ObjNode* this_obj = malloc(sizeof(ObjNode));
     if (this_obj == NULL) {
@@ -230,6 +851,24 @@ ObjNode* parse_obj(char* inp, int len) {
     strncpy(numbuf, inp, len);
     numbuf[len] = '\0';
     this_obj->constant = atoi(numbuf);
+    this_obj->macro = -1;
+    return this_obj;
+  } else if (is_valid_name(inp, len)) {
+    //It is a macro reference (rolls always start with a digit).
+    int macro = find_macro(inp, len);
+    if (macro < 0) {
+      print_error("Unknown macro.");
+      return NULL;
+    }
+    ObjNode* this_obj = malloc(sizeof(ObjNode));
+    if (this_obj == NULL) {
+      print_error("Out of memory.");
+      return NULL;
+    }
+    this_obj->roll = NULL;
+    this_obj->constant = 0;
+    this_obj->subList = NULL;
+    this_obj->macro = macro;
     return this_obj;
   } else {
     //It must be a roll (if it's badly formatted, will be caught further down the line).
@@ -246,6 +885,7 @@ ObjNode* parse_obj(char* inp, int len) {
     this_obj->roll = roll;
     this_obj->constant = 0;
     this_obj->subList = NULL;
+    this_obj->macro = -1;
     return this_obj;
   }
 }
@@ -256,16 +896,16 @@ RollNode* parse_roll(char* inp, int len) {
     print_error("Missing Roll.");
     return NULL;
   }
-  char* d_loc = strchr(inp, 'd');
-  if ((!d_loc) || ((d_loc - inp) >= len)) {
+  char* d_loc = find_roll_letter(inp, len, "d");
+  if (!d_loc) {
     print_error("Garbled roll (no 'd' delimiter).");
     return NULL;
   }
 
-  char* mod_loc = strpbrk(inp, "cbvw");
+  char* mod_loc = find_roll_letter(inp, len, "cbvwsef");
   int mod_chars = 0;
   RollModifier* mod = NULL;
-  if (mod_loc && ((mod_loc - inp) < len)) {
+  if (mod_loc) {
     mod_chars = len - (mod_loc - inp);
     mod = parse_modifier(mod_loc, mod_chars);
     if (mod == NULL) {
@@ -304,6 +944,14 @@ RollNode* parse_roll(char* inp, int len) {
     return NULL;
   }
 
+  int dieSides = atoi(constB);
+  if (mod != NULL && mod->type == COUNT_EXPLODING_SUCCESSES && dieSides == 1) {
+    //A one-sided die always rolls its maximum, so it would explode forever.
+    print_error("Exploding successes (e) cannot be counted on one-sided dice.");
+    free_modifier_node(mod);
+    return NULL;
+  }
+
   RollNode* this_roll = malloc(sizeof(RollNode));
   if (this_roll == NULL) {
     free_modifier_node(mod);
@@ -312,7 +960,7 @@ RollNode* parse_roll(char* inp, int len) {
   }
 
   this_roll->dieCount = atoi(constA);
-  this_roll->dieSides = atoi(constB);
+  this_roll->dieSides = dieSides;
   this_roll->rollMod = mod;
   return this_roll;
 }
@@ -339,6 +987,15 @@ RollModifier* parse_modifier(char* inp, int len) {
   case 'w':
     type = CHOOSE_LOW;
     break;
+  case 's':
+    type = COUNT_SUCCESSES;
+    break;
+  case 'e':
+    type = COUNT_EXPLODING_SUCCESSES;
+    break;
+  case 'f':
+    type = COUNT_SUCCESSES_ONES_CANCEL;
+    break;
   default:
     print_error("Invalid Modifier Character.");
     return NULL;
@@ -422,6 +1079,8 @@ int execute_obj(ObjNode* obj, bool verbose) {
     return execute_roll(obj->roll, verbose);
   } else if (obj->subList != NULL) {
     return execute_expr(obj->subList, verbose);
+  } else if (obj->macro >= 0) {
+    return execute_expr(get_macro_tree(obj->macro), verbose);
   } else {
     return obj->constant;
   }
@@ -556,104 +1215,3026 @@ int execute_exploding_roll(int dieCount, int dieSides, int explodeThresh, bool v
   return sum_up(rolls, dieCount);
 }
 
-/** Execute a die roll. Based on modifiers to the roll type, calls the appropriate roll execution function. */
-int execute_roll(RollNode* roll, bool verbose) {
-  if (roll->rollMod != NULL) {
-    switch(roll->rollMod->type) {
-    case CHOOSE_HIGH:
-      return execute_choose_n_roll(roll->dieCount, roll->dieSides, roll->rollMod->constant, compare_roll_high, verbose);
-    case CHOOSE_LOW:
-      return execute_choose_n_roll(roll->dieCount, roll->dieSides, roll->rollMod->constant, compare_roll_low, verbose);
-    case REROLL_BELOW:
-      return execute_reroll_below_roll(roll->dieCount, roll->dieSides, roll->rollMod->constant, verbose);
-    case KEEP_AND_REROLL_ABOVE:
-      return execute_exploding_roll(roll->dieCount, roll->dieSides, roll->rollMod->constant, verbose);
-    case NONE:
-      return 0; //Should not happen
-    }
-  }
-  return execute_basic_roll(roll->dieCount, roll->dieSides, verbose);
-}
-
-/** Prints a usage message and exits the program. */
-void print_usage() {
-  printf("Usage: dice <flags> <expression>\n See header for expression grammar.\n");
-  printf("Use dice -help for a short explanation.\n");
-  exit(1);
+/** Returns the number of faces of a dieSides-sided die in the range [low, high]. */
+int count_faces_between(int dieSides, int low, int high) {
+  low = low < 1 ? 1 : low;
+  high = high > dieSides ? dieSides : high;
+  return high >= low ? high - low + 1 : 0;
 }
 
-/** Prints a help message explaining some of program use. */
-void print_help() {
-  printf("General die rolls take the form of XdY.\nX is the number of dice to roll and Y is the number of sides of the die for those rolls.\nDie rolls can be composed with infix arithmetic operators (+, -, *, /) and can include constant values (ex. 1d4+4).\n\n-v flag: Enables verbose printing (each individual die rolled will be displayed). Default is to print numbered roll results for overall rolls only.\n\n-q flag: Only print the total value of each roll, newline-delimited, and nothing else (quiet mode). Useful for using the tool as input to other programs.\n\nDie modifiers (appended to end of die rolls):\n    c (Usage XdYcZ): Take only the Z highest results from the X dice rolled.\n    v (Usage XdYvZ): Roll 'exploding' dice, wherein if a value at or above Z is rolled on a given die an extra die (of the same Y many sides) is rolled and also added to the total. Such extra dice can also explode given the same threshold.\n    b (Usage XdYbZ): Reroll individual dice that fall below the threshold Z in value until they result in a value greater than Z.\n    w (Usage XdYwZ): Take only the Z lowest results from the X dice rolled.\n\n");
+/** Computes the probabilities that sample_success_pool draws with: the chance of a success for plain
+ *  pools, or else the chance of a 1 (ones-cancel) or of the maximum face (exploding) in 'p', and the
+ *  chance that one of the remaining faces is a success in 'p2'. Requires dieSides > 1. */
+void success_pool_constants(int dieSides, int successThresh, ModifierType type, double* p, double* p2) {
+  *p = 0.0;
+  *p2 = 0.0;
+  switch (type) {
+  case COUNT_SUCCESSES:
+    *p = count_faces_between(dieSides, successThresh, dieSides) / (double) dieSides;
+    break;
+  case COUNT_SUCCESSES_ONES_CANCEL:
+    *p = 1.0 / dieSides;
+    *p2 = count_faces_between(dieSides, successThresh > 2 ? successThresh : 2, dieSides) / (double) (dieSides - 1);
+    break;
+  case COUNT_EXPLODING_SUCCESSES:
+    *p = 1.0 / dieSides;
+    *p2 = count_faces_between(dieSides, successThresh, dieSides - 1) / (double) (dieSides - 1);
+    break;
+  default:
+    break;
+  }
 }
 
-/** Parses option flags, etc out of the start of the input string. */
-ConfigOptions parse_options(int argc, char** argv) {
-  ConfigOptions opts = { VER_DEFAULT, MODE_CMDLINE, 0 };
-  bool verbose = false;
-  bool quiet = false;
-  int i = 1;
-  for (; (i < argc) && (argv[i][0] == '-'); i++) {
-    if (strcmp(argv[i], "-help") == 0) {
-      if (i == 1) {
-        opts.mode = MODE_HELP;
-      } else {
-        print_usage();
-      }
-      return opts;
-    }
-    if (strcmp(argv[i], "-v") == 0) {
-      verbose = true;
-    }
-    if (strcmp(argv[i], "-q") == 0) {
-      quiet = true;
-    }
-    if (strcmp(argv[i], "-i") == 0) {
-      opts.mode = MODE_INTERACTIVE;
-    }
-  }
-  if (verbose && quiet) {
-    verbose = false;
-    quiet = false;
+/** Samples a success-counting pool directly from its distribution instead of rolling each die, given the
+ *  constants from success_pool_constants. Plain pools are one binomial draw; ones-cancel pools are a
+ *  multinomial split into ones, other successes and failures; exploding pools take one binomial draw
+ *  per generation of rerolled dice, so they cost O(log N) draws for an N-die pool. */
+int sample_success_pool(int dieCount, int dieSides, int successThresh, ModifierType type, double p, double p2) {
+  switch (type) {
+  case COUNT_SUCCESSES:
+    return sample_binomial(dieCount, p);
+  case COUNT_SUCCESSES_ONES_CANCEL: {
+    int ones = sample_binomial(dieCount, p);
+    int others = sample_binomial(dieCount - ones, p2);
+    return others + ((successThresh <= 1) ? ones : 0) - ones;
   }
-  if (verbose) {
-    opts.verbosity = VER_VERBOSE;
+  case COUNT_EXPLODING_SUCCESSES: {
+    bool maxSucceeds = (successThresh <= dieSides);
+    int successes = 0;
+    int rolling = dieCount;
+    while (rolling > 0) {
+      int exploded = sample_binomial(rolling, p);
+      successes += (maxSucceeds ? exploded : 0) + sample_binomial(rolling - exploded, p2);
+      rolling = exploded;
+    }
+    return successes;
   }
-  if (quiet) {
-    opts.verbosity = VER_QUIET;
+  default:
+    return 0;
   }
-  opts.option_count = i-1;
-  return opts;
 }
 
-/** Handles the overall operation of the program in command-line invocational mode. */
-void parse_and_exec_cmdline(int argc, char** argv, ConfigOptions options) {
-  if (argc == 0) {
-    print_usage();
+/** Execute a roll that counts the dice at or above a threshold instead of summing them, optionally with
+ *  dice showing their maximum face rolling again ('e') or with each 1 rolled cancelling a success ('f'). */
+int execute_success_roll(int dieCount, int dieSides, int successThresh, ModifierType type, bool verbose) {
+  if (!verbose && dieCount >= SUCCESS_POOL_FAST_MIN && dieSides > 1) {
+    double p, p2;
+    success_pool_constants(dieSides, successThresh, type, &p, &p2);
+    return sample_success_pool(dieCount, dieSides, successThresh, type, p, p2);
   }
-  bool verbose = (options.verbosity == VER_VERBOSE);
-  bool quiet = (options.verbosity == VER_QUIET);
-
-  init_random();
+  int typechar = (type == COUNT_EXPLODING_SUCCESSES) ? 'e' : ((type == COUNT_SUCCESSES_ONES_CANCEL) ? 'f' : 's');
   if (verbose) {
-    printf("----------------------------\n");
+    printf("%dd%d%c%d:\n", dieCount, dieSides, typechar, successThresh);
   }
-  for (int i = 0; i < argc; i++) {
-    if (!quiet) {
-      printf("Roll %d:", i + 1);
-    }
+  int successes = 0;
+  for (int i = 0; i < dieCount; i++) {
+    int roll = (get_next_random() % dieSides) + 1;
     if (verbose) {
-      printf("\n----------------------------\n");
-    } else if (!quiet) {
-      printf(" ");
+      printf("  %d", roll);
     }
-    ExprList* tree = parse_expr(argv[i], strlen(argv[i]), A_OP);
+    for (;;) {
+      if (roll >= successThresh) {
+        successes++;
+        if (verbose) {
+          printf(" * Success");
+        }
+      }
+      if (type == COUNT_SUCCESSES_ONES_CANCEL && roll == 1) {
+        successes--;
+        if (verbose) {
+          printf(" * Cancels a success");
+        }
+      }
+      if (type != COUNT_EXPLODING_SUCCESSES || roll != dieSides) {
+        break;
+      }
+      if (verbose) {
+        printf(" * Exploded:\n");
+      }
+      roll = (get_next_random() % dieSides) + 1;
+      if (verbose) {
+        printf("    %d", roll);
+      }
+    }
+    if (verbose) {
+      printf("\n");
+    }
+  }
+  if (verbose) {
+    printf("Successes: %d\n", successes);
+  }
+  return successes;
+}
+
+/** Execute a die roll given as its parts. Based on the modifier type, calls the appropriate roll execution function. */
+int execute_roll_parts(int dieCount, int dieSides, ModifierType type, int modConstant, bool verbose) {
+  switch(type) {
+  case CHOOSE_HIGH:
+    return execute_choose_n_roll(dieCount, dieSides, modConstant, compare_roll_high, verbose);
+  case CHOOSE_LOW:
+    return execute_choose_n_roll(dieCount, dieSides, modConstant, compare_roll_low, verbose);
+  case REROLL_BELOW:
+    return execute_reroll_below_roll(dieCount, dieSides, modConstant, verbose);
+  case KEEP_AND_REROLL_ABOVE:
+    return execute_exploding_roll(dieCount, dieSides, modConstant, verbose);
+  case COUNT_SUCCESSES:
+  case COUNT_EXPLODING_SUCCESSES:
+  case COUNT_SUCCESSES_ONES_CANCEL:
+    return execute_success_roll(dieCount, dieSides, modConstant, type, verbose);
+  case NONE:
+  default:
+    return execute_basic_roll(dieCount, dieSides, verbose);
+  }
+}
+
+/** Execute a die roll. Based on modifiers to the roll type, calls the appropriate roll execution function. */
+int execute_roll(RollNode* roll, bool verbose) {
+  TRACE_BEGIN(t);
+  int result;
+  if (roll->rollMod != NULL) {
+    result = execute_roll_parts(roll->dieCount, roll->dieSides, roll->rollMod->type, roll->rollMod->constant, verbose);
+  } else {
+    result = execute_roll_parts(roll->dieCount, roll->dieSides, NONE, 0, verbose);
+  }
+  TRACE_END(t, "execute_roll");
+  return result;
+}
+
+/** Rolls dieCount dice of dieSides sides once per lane, summing each lane's dice. This is the hot loop of
+ *  batch evaluation, so it draws straight from this thread's simulation generator when one is active. */
+void roll_basic_batch(int dieCount, int dieSides, int* out, int lanes) {
+  RandomState* random = active_random;
+  for (int l = 0; l < lanes; l++) {
+    int sum = 0;
+    if (random != NULL) {
+      for (int d = 0; d < dieCount; d++) {
+        sum += (int) ((random_state_next(random) >> 33) % dieSides) + 1;
+      }
+    } else {
+      for (int d = 0; d < dieCount; d++) {
+        sum += (get_next_random() % dieSides) + 1;
+      }
+    }
+    out[l] = sum;
+  }
+}
+
+/** Rolls one roll node once per lane. */
+void execute_roll_batch(RollNode* roll, int* out, int lanes) {
+  ModifierType type = (roll->rollMod != NULL) ? roll->rollMod->type : NONE;
+  int modConstant = (roll->rollMod != NULL) ? roll->rollMod->constant : 0;
+  if (type == NONE) {
+    roll_basic_batch(roll->dieCount, roll->dieSides, out, lanes);
+  } else if ((type == COUNT_SUCCESSES || type == COUNT_EXPLODING_SUCCESSES || type == COUNT_SUCCESSES_ONES_CANCEL) &&
+             roll->dieCount >= SUCCESS_POOL_FAST_MIN && roll->dieSides > 1) {
+    double p, p2;
+    success_pool_constants(roll->dieSides, modConstant, type, &p, &p2);
+    for (int l = 0; l < lanes; l++) {
+      out[l] = sample_success_pool(roll->dieCount, roll->dieSides, modConstant, type, p, p2);
+    }
+  } else {
+    for (int l = 0; l < lanes; l++) {
+      out[l] = execute_roll_parts(roll->dieCount, roll->dieSides, type, modConstant, false);
+    }
+  }
+}
+
+#ifdef USING_AVX2_BATCH
+__attribute__((target("avx2")))
+void batch_op_avx2(Operation opt, int* lhs, const int* rhs, int lanes) {
+  int l = 0;
+  for (; l + 8 <= lanes; l += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (lhs + l));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (rhs + l));
+    __m256i r = (opt == PLUS) ? _mm256_add_epi32(a, b) : (opt == MINUS) ? _mm256_sub_epi32(a, b) : _mm256_mullo_epi32(a, b);
+    _mm256_storeu_si256((__m256i*) (lhs + l), r);
+  }
+  for (; l < lanes; l++) {
+    lhs[l] = (opt == PLUS) ? lhs[l] + rhs[l] : (opt == MINUS) ? lhs[l] - rhs[l] : lhs[l] * rhs[l];
+  }
+}
+#endif
+
+/** Applies an arithmetic operation lane by lane: lhs[l] = lhs[l] opt rhs[l]. */
+void batch_op(Operation opt, int* lhs, const int* rhs, int lanes) {
+#ifdef USING_AVX2_BATCH
+  if (cpu_has_avx2() && opt != DIVIDE) {
+    batch_op_avx2(opt, lhs, rhs, lanes);
+    return;
+  }
+#endif
+  switch (opt) {
+  case PLUS:
+    for (int l = 0; l < lanes; l++) {
+      lhs[l] += rhs[l];
+    }
+    break;
+  case MINUS:
+    for (int l = 0; l < lanes; l++) {
+      lhs[l] -= rhs[l];
+    }
+    break;
+  case TIMES:
+    for (int l = 0; l < lanes; l++) {
+      lhs[l] *= rhs[l];
+    }
+    break;
+  case DIVIDE:
+    // No vector integer division; this stays scalar on every path.
+    for (int l = 0; l < lanes; l++) {
+      lhs[l] /= rhs[l];
+    }
+    break;
+  default:
+    print_error("Unrecognized operation.");
+    exit(1);
+  }
+}
+
+/** Evaluates an object node for 'lanes' independent trials at once. */
+void execute_obj_batch(ObjNode* obj, int* out, int lanes) {
+  if (obj->roll != NULL) {
+    execute_roll_batch(obj->roll, out, lanes);
+  } else if (obj->subList != NULL) {
+    execute_expr_batch(obj->subList, out, lanes);
+  } else if (obj->macro >= 0) {
+    execute_expr_batch(get_macro_tree(obj->macro), out, lanes);
+  } else {
+    for (int l = 0; l < lanes; l++) {
+      out[l] = obj->constant;
+    }
+  }
+}
+
+/** Evaluates an expression for 'lanes' (at most BATCH_LANES) independent trials at once, in structure-of-arrays
+ *  form: every node produces one result per lane and each operator is applied across all lanes in one pass.
+ *  Equivalent to calling execute_expr (non-verbose) 'lanes' times, although random numbers are drawn in a
+ *  different order. */
+void execute_expr_batch(ExprList* expr, int* out, int lanes) {
+  if (expr->lhList != NULL) {
+    execute_expr_batch(expr->lhList, out, lanes);
+  } else {
+    execute_obj_batch(expr->obj, out, lanes);
+  }
+  if (!expr_is_singlet(expr)) {
+    int rhs[BATCH_LANES];
+    execute_expr_batch(expr->rhList, rhs, lanes);
+    batch_op(expr->opt, out, rhs, lanes);
+  }
+}
+
+/** Appends an instruction to a plan, folding arithmetic on two constants into a single constant
+ *  (except division by zero, which is left to fail at run time as it would unfolded). */
+bool plan_emit(Plan* plan, PlanOp op) {
+  if (op.code != PLAN_CONST && op.code != PLAN_ROLL && plan->count >= 2 &&
+      plan->ops[plan->count-1].code == PLAN_CONST && plan->ops[plan->count-2].code == PLAN_CONST &&
+      !(op.code == PLAN_DIV && plan->ops[plan->count-1].value == 0)) {
+    int lhs = plan->ops[plan->count-2].value;
+    int rhs = plan->ops[plan->count-1].value;
+    int folded = 0;
+    switch (op.code) {
+    case PLAN_ADD:
+      folded = lhs + rhs;
+      break;
+    case PLAN_SUB:
+      folded = lhs - rhs;
+      break;
+    case PLAN_MUL:
+      folded = lhs * rhs;
+      break;
+    case PLAN_DIV:
+      folded = lhs / rhs;
+      break;
+    }
+    plan->count--;
+    plan->depth--;
+    plan->ops[plan->count-1].value = folded;
+    return true;
+  }
+  if (plan->count == plan->cap) {
+    int cap = plan->cap ? plan->cap * 2 : 16;
+    PlanOp* grown = realloc(plan->ops, sizeof(PlanOp) * cap);
+    if (grown == NULL) {
+      print_error("Out of memory.");
+      return false;
+    }
+    plan->ops = grown;
+    plan->cap = cap;
+  }
+  plan->ops[plan->count++] = op;
+  plan->depth += (op.code == PLAN_CONST || op.code == PLAN_ROLL) ? 1 : -1;
+  if (plan->depth > plan->max_depth) {
+    plan->max_depth = plan->depth;
+  }
+  return true;
+}
+
+/** Compiles an object node of a parse tree onto the end of a plan. */
+bool compile_obj(ObjNode* obj, Plan* plan) {
+  PlanOp op;
+  memset(&op, 0, sizeof(PlanOp));
+  if (obj->roll != NULL) {
+    RollNode* roll = obj->roll;
+    op.code = PLAN_ROLL;
+    op.value = roll->dieCount;
+    op.dieSides = roll->dieSides;
+    op.modType = (roll->rollMod != NULL) ? roll->rollMod->type : NONE;
+    op.modConstant = (roll->rollMod != NULL) ? roll->rollMod->constant : 0;
+    if ((op.modType == COUNT_SUCCESSES || op.modType == COUNT_EXPLODING_SUCCESSES ||
+         op.modType == COUNT_SUCCESSES_ONES_CANCEL) && op.dieSides > 1) {
+      success_pool_constants(op.dieSides, op.modConstant, op.modType, &op.p, &op.p2);
+    }
+    return plan_emit(plan, op);
+  } else if (obj->subList != NULL) {
+    return compile_expr(obj->subList, plan);
+  } else if (obj->macro >= 0) {
+    // Inline the macro's already-compiled plan rather than compiling its tree again.
+    Plan* macro = get_macro_plan(obj->macro);
+    for (int i = 0; i < macro->count; i++) {
+      if (!plan_emit(plan, macro->ops[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+  op.code = PLAN_CONST;
+  op.value = obj->constant;
+  return plan_emit(plan, op);
+}
+
+/** Compiles a parse tree into a postfix plan. Operands are emitted in the order execute_expr
+ *  evaluates them, so a plan consumes random numbers exactly as its tree would. */
+bool compile_expr(ExprList* expr, Plan* plan) {
+  bool ok = (expr->lhList != NULL) ? compile_expr(expr->lhList, plan) : compile_obj(expr->obj, plan);
+  if (!ok || expr_is_singlet(expr)) {
+    return ok;
+  }
+  if (!compile_expr(expr->rhList, plan)) {
+    return false;
+  }
+  PlanOp op;
+  memset(&op, 0, sizeof(PlanOp));
+  switch (expr->opt) {
+  case PLUS:
+    op.code = PLAN_ADD;
+    break;
+  case MINUS:
+    op.code = PLAN_SUB;
+    break;
+  case TIMES:
+    op.code = PLAN_MUL;
+    break;
+  case DIVIDE:
+    op.code = PLAN_DIV;
+    break;
+  default:
+    print_error("Unrecognized operation.");
+    return false;
+  }
+  return plan_emit(plan, op);
+}
+
+/** Frees the instructions held by a plan, leaving it empty. */
+void free_plan(Plan* plan) {
+  free(plan->ops);
+  memset(plan, 0, sizeof(Plan));
+}
+
+/** Executes one roll instruction of a plan, using its precomputed constants for large success pools. */
+int execute_plan_roll(const PlanOp* op, bool verbose) {
+  ModifierType type = (ModifierType) op->modType;
+  if ((type == COUNT_SUCCESSES || type == COUNT_EXPLODING_SUCCESSES || type == COUNT_SUCCESSES_ONES_CANCEL) &&
+      !verbose && op->value >= SUCCESS_POOL_FAST_MIN && op->dieSides > 1) {
+    return sample_success_pool(op->value, op->dieSides, op->modConstant, type, op->p, op->p2);
+  }
+  return execute_roll_parts(op->value, op->dieSides, type, op->modConstant, verbose);
+}
+
+/** Executes a compiled plan. 'stackDepth' must be at least the plan's maximum stack depth. */
+int execute_plan(const PlanOp* ops, int count, int stackDepth, bool verbose) {
+  TRACE_BEGIN(t);
+  STACK_ALLOC(int, stack, stackDepth);
+  int top = 0;
+  for (int i = 0; i < count; i++) {
+    const PlanOp* op = &ops[i];
+    switch (op->code) {
+    case PLAN_CONST:
+      stack[top++] = op->value;
+      break;
+    case PLAN_ROLL:
+      stack[top++] = execute_plan_roll(op, verbose);
+      break;
+    case PLAN_ADD:
+      top--;
+      stack[top-1] = stack[top-1] + stack[top];
+      break;
+    case PLAN_SUB:
+      top--;
+      stack[top-1] = stack[top-1] - stack[top];
+      break;
+    case PLAN_MUL:
+      top--;
+      stack[top-1] = stack[top-1] * stack[top];
+      break;
+    case PLAN_DIV:
+      top--;
+      stack[top-1] = stack[top-1] / stack[top];
+      break;
+    }
+  }
+  TRACE_END(t, "execute_plan");
+  return stack[0];
+}
+
+/** Reads a whole file into a NUL-terminated buffer (caller frees), or returns NULL. */
+char* read_file_contents(char* path, size_t* len) {
+  FILE* in = fopen(path, "rb");
+  if (in == NULL) {
+    return NULL;
+  }
+  size_t cap = 4096;
+  size_t used = 0;
+  char* data = malloc(cap);
+  while (data != NULL) {
+    used += fread(data + used, 1, cap - used - 1, in);
+    if (used < cap - 1) {
+      break;
+    }
+    char* grown = realloc(data, cap * 2);
+    if (grown == NULL) {
+      free(data);
+      data = NULL;
+      break;
+    }
+    data = grown;
+    cap *= 2;
+  }
+  fclose(in);
+  if (data != NULL) {
+    data[used] = '\0';
+    *len = used;
+  }
+  return data;
+}
+
+/** Returns true iff 'name' (of length len) is a valid plan or macro name: a letter or underscore,
+ *  followed by letters, digits or underscores. */
+bool is_valid_name(const char* name, int len) {
+  if (len <= 0 || !(((name[0] | 0x20) >= 'a' && (name[0] | 0x20) <= 'z') || name[0] == '_')) {
+    return false;
+  }
+  for (int i = 1; i < len; i++) {
+    char c = name[i];
+    if (!(((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (c >= '0' && c <= '9') || c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Trims leading and trailing whitespace from [*start, *start + *len). */
+void trim_span(char** start, int* len) {
+  while (*len > 0 && strchr(" \t\r\n", **start)) {
+    (*start)++;
+    (*len)--;
+  }
+  while (*len > 0 && strchr(" \t\r\n", (*start)[*len - 1])) {
+    (*len)--;
+  }
+}
+
+/** Reads the next definition from a file of expressions (one per line, optionally preceded by 'name:'),
+ *  skipping blank lines and lines starting with '#'. Advances *cursor and *line_number, and sets *name
+ *  to NULL for an unnamed expression. Returns false at the end of the text. */
+bool next_definition(char** cursor, int* line_number, char** name, int* name_len, char** expr, int* expr_len) {
+  while (**cursor) {
+    (*line_number)++;
+    char* line = *cursor;
+    char* eol = strchr(line, '\n');
+    int line_len = eol ? (int) (eol - line) : (int) strlen(line);
+    *cursor = eol ? eol + 1 : line + line_len;
+    *name = NULL;
+    *name_len = 0;
+    *expr = line;
+    *expr_len = line_len;
+    trim_span(expr, expr_len);
+    if (*expr_len == 0 || (*expr)[0] == '#') {
+      continue;
+    }
+    char* colon = memchr(*expr, ':', *expr_len);
+    if (colon != NULL) {
+      *name = *expr;
+      *name_len = colon - *expr;
+      trim_span(name, name_len);
+      *expr_len -= (colon + 1) - *expr;
+      *expr = colon + 1;
+      trim_span(expr, expr_len);
+    }
+    return true;
+  }
+  return false;
+}
+
+// The names and source text of the plans being compiled, stored back to back.
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} StringTable;
+
+/** Appends 'len' chars to a string table. Returns false if out of memory. */
+bool string_table_add(StringTable* table, const char* text, size_t len) {
+  if (table->len + len > table->cap) {
+    size_t cap = table->cap ? table->cap : 256;
+    while (cap < table->len + len) {
+      cap *= 2;
+    }
+    char* grown = realloc(table->data, cap);
+    if (grown == NULL) {
+      return false;
+    }
+    table->data = grown;
+    table->cap = cap;
+  }
+  memcpy(table->data + table->len, text, len);
+  table->len += len;
+  return true;
+}
+
+/** Returns the deepest the stack gets while running a plan. This can be less than the plan's
+ *  max_depth, which is not lowered when constants are folded. */
+int plan_stack_depth(const PlanOp* ops, int count) {
+  int depth = 0, max_depth = 0;
+  for (int i = 0; i < count; i++) {
+    depth += (ops[i].code == PLAN_CONST || ops[i].code == PLAN_ROLL) ? 1 : -1;
+    if (depth > max_depth) {
+      max_depth = depth;
+    }
+  }
+  return max_depth;
+}
+
+/** Returns whether a roll instruction is within the limits on die counts that plan files enforce. */
+bool plan_roll_in_range(const PlanOp* op) {
+  bool choose = (op->modType == CHOOSE_HIGH || op->modType == CHOOSE_LOW);
+  return op->value >= 0 && op->value <= PLAN_MAX_DIE_COUNT && op->modConstant >= 0 &&
+         (!choose || op->modConstant <= PLAN_MAX_DIE_COUNT);
+}
+
+/** Checks that a compiled plan is within the limits open_plan_file enforces, reporting it if not. */
+bool plan_fits_file(Plan* plan) {
+  if (plan_stack_depth(plan->ops, plan->count) > PLAN_MAX_STACK_DEPTH) {
+    print_error("Expression is too long for a plan file.");
+    return false;
+  }
+  for (int i = 0; i < plan->count; i++) {
+    if (plan->ops[i].code == PLAN_ROLL && !plan_roll_in_range(&plan->ops[i])) {
+      print_error("Roll is out of range for a plan file (at most 1000000 dice).");
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Handles -compile: parses, validates and compiles every expression in the input file (one per line,
+ *  optionally preceded by 'name:'; blank lines and lines starting with '#' are skipped) and writes them
+ *  to a plan file. Nothing is written if any line fails to compile. */
+void parse_and_exec_compile(ConfigOptions options) {
+  if (options.output_path == NULL) {
+    print_error("-compile requires -o FILE for the plan file to write.");
+    exit(1);
+  }
+  size_t text_len;
+  char* text = read_file_contents(options.input_path, &text_len);
+  if (text == NULL) {
+    print_error("Could not read expression file.");
+    exit(1);
+  }
+  // Classify the whole file once, as stream mode does its chunks, for parsing every expression in it.
+  ScanIndex index;
+  memset(&index, 0, sizeof(ScanIndex));
+  if (scan_index_build(&index, text, text_len)) {
+    set_scan_index(&index);
+  }
+
+  int plan_count = 0, plan_cap = 16;
+  PlanFileEntry* entries = malloc(sizeof(PlanFileEntry) * plan_cap);
+  Plan all_ops;
+  memset(&all_ops, 0, sizeof(Plan));
+  StringTable strings;
+  memset(&strings, 0, sizeof(StringTable));
+  bool ok = (entries != NULL);
+
+  int line_number = 0;
+  char* cursor = text;
+  char* name;
+  int name_len;
+  char* expr;
+  int expr_len;
+  while (ok && next_definition(&cursor, &line_number, &name, &name_len, &expr, &expr_len)) {
+    if (name != NULL) {
+      if (!is_valid_name(name, name_len)) {
+        print_error("Invalid plan name.");
+        ok = false;
+        break;
+      }
+      for (int i = 0; i < plan_count; i++) {
+        if (entries[i].name_len == (uint32_t) name_len && memcmp(strings.data + entries[i].name_offset, name, name_len) == 0) {
+          print_error("Duplicate plan name.");
+          ok = false;
+        }
+      }
+      if (!ok) {
+        break;
+      }
+    }
+
+    ExprList* tree = parse_expr(expr, expr_len, A_OP);
+    Plan plan;
+    memset(&plan, 0, sizeof(Plan));
+    if (tree == NULL || !compile_expr(tree, &plan)) {
+      free_expr_node(tree);
+      free_plan(&plan);
+      ok = false;
+      break;
+    }
+    free_expr_node(tree);
+    if (!plan_fits_file(&plan)) {
+      free_plan(&plan);
+      ok = false;
+      break;
+    }
+
+    if (plan_count == plan_cap) {
+      plan_cap *= 2;
+      PlanFileEntry* grown = realloc(entries, sizeof(PlanFileEntry) * plan_cap);
+      if (grown == NULL) {
+        print_error("Out of memory.");
+        free_plan(&plan);
+        ok = false;
+        break;
+      }
+      entries = grown;
+    }
+    PlanFileEntry* entry = &entries[plan_count++];
+    memset(entry, 0, sizeof(PlanFileEntry));
+    entry->op_offset = all_ops.count;
+    entry->op_count = plan.count;
+    entry->stack_depth = plan_stack_depth(plan.ops, plan.count);
+    entry->name_offset = strings.len;
+    entry->name_len = name_len;
+    entry->source_offset = strings.len + name_len;
+    entry->source_len = expr_len;
+    if (!string_table_add(&strings, name ? name : "", name_len) || !string_table_add(&strings, expr, expr_len)) {
+      print_error("Out of memory.");
+      free_plan(&plan);
+      ok = false;
+      break;
+    }
+    for (int i = 0; ok && i < plan.count; i++) {
+      // Appended directly: each plan was already folded as it was compiled.
+      if (all_ops.count == all_ops.cap) {
+        int cap = all_ops.cap ? all_ops.cap * 2 : 64;
+        PlanOp* grown = realloc(all_ops.ops, sizeof(PlanOp) * cap);
+        if (grown == NULL) {
+          print_error("Out of memory.");
+          ok = false;
+          break;
+        }
+        all_ops.ops = grown;
+        all_ops.cap = cap;
+      }
+      all_ops.ops[all_ops.count++] = plan.ops[i];
+    }
+    free_plan(&plan);
+  }
+  set_scan_index(NULL);
+  scan_index_free(&index);
+  free(text);
+
+  if (!ok) {
+    char message[96];
+    snprintf(message, sizeof(message), "Could not compile line %d; no plan file written.", line_number);
+    print_error(message);
+  } else {
+    FILE* out = fopen(options.output_path, "wb");
+    if (out == NULL) {
+      print_error("Could not open plan output file.");
+      ok = false;
+    } else {
+      PlanFileHeader header;
+      memset(&header, 0, sizeof(PlanFileHeader));
+      memcpy(header.magic, PLAN_FILE_MAGIC, 8);
+      header.version = PLAN_FILE_VERSION;
+      header.byte_order = PLAN_FILE_BYTE_ORDER;
+      header.plan_count = plan_count;
+      header.op_total = all_ops.count;
+      size_t strings_offset = sizeof(PlanFileHeader) + sizeof(PlanFileEntry) * plan_count + sizeof(PlanOp) * all_ops.count;
+      header.file_size = strings_offset + strings.len;
+      fwrite(&header, sizeof(PlanFileHeader), 1, out);
+      fwrite(entries, sizeof(PlanFileEntry), plan_count, out);
+      fwrite(all_ops.ops, sizeof(PlanOp), all_ops.count, out);
+      fwrite(strings.data, 1, strings.len, out);
+      ok = !ferror(out);
+      if (fclose(out) != 0 || !ok) {
+        print_error("Failed writing plan file.");
+        ok = false;
+      } else if (options.verbosity != VER_QUIET) {
+        printf("Compiled %d expressions to %s\n", plan_count, options.output_path);
+      }
+    }
+  }
+  free(entries);
+  free_plan(&all_ops);
+  free(strings.data);
+  if (!ok) {
+    exit(1);
+  }
+}
+
+/** Releases a plan file opened by open_plan_file. */
+void close_plan_file(PlanFile* file) {
+  if (file->base == NULL) {
+    return;
+  }
+#ifndef _WIN32
+  if (file->mapped) {
+    munmap(file->base, file->size);
+  } else {
+    free(file->base);
+  }
+#else
+  free(file->base);
+#endif
+  memset(file, 0, sizeof(PlanFile));
+}
+
+/** Maps a plan file into memory and checks that it is one this build can execute: the header must
+ *  match, every plan must lie within the file, and every plan must be a well-formed postfix program
+ *  whose stack fits in the depth recorded, within the limits on depth and die counts.
+ *  'found_version' receives the file's format version. */
+PlanError open_plan_file(char* path, PlanFile* file, uint32_t* found_version) {
+  memset(file, 0, sizeof(PlanFile));
+  *found_version = 0;
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return PLAN_ERR_OPEN;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return PLAN_ERR_OPEN;
+  }
+  file->size = st.st_size;
+  if (file->size >= sizeof(PlanFileHeader)) {
+    void* map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      file->base = map;
+      file->mapped = true;
+    }
+  }
+  close(fd);
+  if (file->base == NULL) {
+    file->size = 0;
+    return PLAN_ERR_NOT_PLAN_FILE;
+  }
+#else
+  file->base = (unsigned char*) read_file_contents(path, &file->size);
+  if (file->base == NULL) {
+    return PLAN_ERR_OPEN;
+  }
+#endif
+  const PlanFileHeader* header = (const PlanFileHeader*) file->base;
+  if (file->size < sizeof(PlanFileHeader) || memcmp(header->magic, PLAN_FILE_MAGIC, 8) != 0) {
+    return PLAN_ERR_NOT_PLAN_FILE;
+  }
+  *found_version = header->version;
+  if (header->byte_order != PLAN_FILE_BYTE_ORDER) {
+    return PLAN_ERR_BYTE_ORDER;
+  }
+  if (header->version != PLAN_FILE_VERSION) {
+    return PLAN_ERR_VERSION;
+  }
+  uint64_t strings_offset = sizeof(PlanFileHeader) + (uint64_t) sizeof(PlanFileEntry) * header->plan_count +
+                            (uint64_t) sizeof(PlanOp) * header->op_total;
+  if (header->file_size != file->size || strings_offset > file->size) {
+    return PLAN_ERR_CORRUPT;
+  }
+  file->header = header;
+  file->entries = (const PlanFileEntry*) (file->base + sizeof(PlanFileHeader));
+  file->ops = (const PlanOp*) (file->entries + header->plan_count);
+  file->strings = (const char*) (file->base + strings_offset);
+  uint64_t strings_len = file->size - strings_offset;
+  for (uint32_t i = 0; i < header->plan_count; i++) {
+    const PlanFileEntry* entry = &file->entries[i];
+    if ((uint64_t) entry->op_offset + entry->op_count > header->op_total || entry->op_count == 0 ||
+        (uint64_t) entry->name_offset + entry->name_len > strings_len ||
+        (uint64_t) entry->source_offset + entry->source_len > strings_len) {
+      return PLAN_ERR_CORRUPT;
+    }
+    int depth = 0;
+    int max_depth = 0;
+    for (uint32_t j = 0; j < entry->op_count; j++) {
+      const PlanOp* op = &file->ops[entry->op_offset + j];
+      if (op->code == PLAN_CONST || op->code == PLAN_ROLL) {
+        depth++;
+      } else if (op->code >= PLAN_ADD && op->code <= PLAN_DIV) {
+        depth--;
+      } else {
+        return PLAN_ERR_CORRUPT;
+      }
+      if (depth < 1) {
+        return PLAN_ERR_CORRUPT;
+      }
+      if (depth > max_depth) {
+        max_depth = depth;
+      }
+      if (op->code == PLAN_ROLL && (op->dieSides < 1 || op->modType < NONE || op->modType > COUNT_SUCCESSES_ONES_CANCEL ||
+                                    !plan_roll_in_range(op) || (op->modType == COUNT_EXPLODING_SUCCESSES && op->dieSides == 1))) {
+        return PLAN_ERR_CORRUPT;
+      }
+    }
+    // The recorded depth sizes the execution stack, so it must cover the program and be bounded. (Files
+    // from earlier builds may record more than needed, since folding did not lower the depth.)
+    if (depth != 1 || max_depth > (int) entry->stack_depth || entry->stack_depth > PLAN_MAX_STACK_DEPTH) {
+      return PLAN_ERR_CORRUPT;
+    }
+  }
+  return PLAN_OK;
+}
+
+/** Reports a plan file error, with the detail appropriate to its kind. */
+void print_plan_error(PlanError err, char* path, uint32_t found_version, char* plan) {
+  char message[MAX_CMDLEN + 128];
+  switch (err) {
+  case PLAN_OK:
+    return;
+  case PLAN_ERR_OPEN:
+    snprintf(message, sizeof(message), "%s: could not open plan file.", path);
+    break;
+  case PLAN_ERR_NOT_PLAN_FILE:
+    snprintf(message, sizeof(message), "%s: not a dice plan file.", path);
+    break;
+  case PLAN_ERR_VERSION:
+    snprintf(message, sizeof(message), "%s: plan file format version %u is not supported (this build reads version %d; recompile the plans).",
+             path, found_version, PLAN_FILE_VERSION);
+    break;
+  case PLAN_ERR_BYTE_ORDER:
+    snprintf(message, sizeof(message), "%s: plan file was written on a machine with a different byte order (recompile the plans).", path);
+    break;
+  case PLAN_ERR_CORRUPT:
+    snprintf(message, sizeof(message), "%s: plan file is truncated or corrupt.", path);
+    break;
+  case PLAN_ERR_NO_SUCH_PLAN:
+    snprintf(message, sizeof(message), "%s: no plan named or numbered '%.*s'.", path, MAX_CMDLEN, plan);
+    break;
+  }
+  print_error(message);
+}
+
+/** Finds a plan in an open plan file by index (counting from 0) or by name. */
+PlanError find_plan(PlanFile* file, char* ref, const PlanFileEntry** found) {
+  size_t ref_len = strlen(ref);
+  if (ref_len > 0 && strspn(ref, "0123456789") == ref_len) {
+    unsigned long index = strtoul(ref, NULL, 10);
+    if (index < file->header->plan_count) {
+      *found = &file->entries[index];
+      return PLAN_OK;
+    }
+    return PLAN_ERR_NO_SUCH_PLAN;
+  }
+  for (uint32_t i = 0; i < file->header->plan_count; i++) {
+    const PlanFileEntry* entry = &file->entries[i];
+    if (entry->name_len == ref_len && memcmp(file->strings + entry->name_offset, ref, ref_len) == 0) {
+      *found = entry;
+      return PLAN_OK;
+    }
+  }
+  return PLAN_ERR_NO_SUCH_PLAN;
+}
+
+/** Handles -plans: executes plans from a compiled plan file, by index or name, with no parsing. With
+ *  no plans given, lists the plans in the file. */
+void parse_and_exec_plans(int argc, char** argv, ConfigOptions options) {
+  PlanFile file;
+  uint32_t found_version;
+  PlanError err = open_plan_file(options.plan_path, &file, &found_version);
+  if (err != PLAN_OK) {
+    print_plan_error(err, options.plan_path, found_version, NULL);
+    close_plan_file(&file);
+    exit(1);
+  }
+  bool verbose = (options.verbosity == VER_VERBOSE);
+  bool quiet = (options.verbosity == VER_QUIET);
+
+  if (argc == 0) {
+    for (uint32_t i = 0; i < file.header->plan_count; i++) {
+      const PlanFileEntry* entry = &file.entries[i];
+      printf("%u\t%.*s\t%.*s\n", i, (int) entry->name_len, file.strings + entry->name_offset,
+             (int) entry->source_len, file.strings + entry->source_offset);
+    }
+    close_plan_file(&file);
+    return;
+  }
+
+  init_random();
+  if (verbose) {
+    printf("----------------------------\n");
+  }
+  for (int i = 0; i < argc; i++) {
+    if (!quiet) {
+      printf("Roll %d:", i + 1);
+    }
+    if (verbose) {
+      printf("\n----------------------------\n");
+    } else if (!quiet) {
+      printf(" ");
+    }
+    const PlanFileEntry* entry = NULL;
+    err = find_plan(&file, argv[i], &entry);
+    if (err != PLAN_OK) {
+      print_plan_error(err, options.plan_path, found_version, argv[i]);
+    } else {
+      int result = execute_plan(file.ops + entry->op_offset, entry->op_count, entry->stack_depth, verbose);
+      if (verbose) {
+        printf("Total: ");
+      }
+      printf("%d\n", result);
+    }
+    if (verbose) {
+      printf("----------------------------\n");
+    }
+  }
+  close_plan_file(&file);
+}
+
+/** Prints a usage message and exits the program. */
+void print_usage() {
+  printf("Usage: dice <flags> <expression>\n See header for expression grammar.\n");
+  printf("Use dice -help for a short explanation.\n");
+  exit(1);
+}
+
+/** Prints a help message explaining some of program use. */
+void print_help() {
+  printf("General die rolls take the form of XdY.\nX is the number of dice to roll and Y is the number of sides of the die for those rolls.\nDie rolls can be composed with infix arithmetic operators (+, -, *, /) and can include constant values (ex. 1d4+4).\n\n-v flag: Enables verbose printing (each individual die rolled will be displayed). Default is to print numbered roll results for overall rolls only.\n\n-q flag: Only print the total value of each roll, newline-delimited, and nothing else (quiet mode). Useful for using the tool as input to other programs.\n\n-trace FILE: Write a timeline of parse/execute/output spans to FILE in Chrome trace-event format (builds made with 'make trace' only).\n\n-sim N: Roll a single expression N times and print summary statistics. Add -seed S for a reproducible run, -shard i/n to run only the i-th of n non-overlapping slices of the trials, and -o FILE to write the results to a shard file.\n\n-sim-until: Roll a single expression in batches until the confidence interval for its mean (-mean-precision E, default 0.01) or for each -query probability (-precision E, default 0.001) is no wider than +/- E, at -confidence C (default 0.95), or until -max-trials N (default 1000000000) or -max-seconds S is reached.\n\n-stream: Read lines of rolls from standard input and print their results in order, without prompts, spreading the work over -threads N evaluator threads (default: one per CPU).\n\n-bench-scan FILE: Report how fast the lines of rolls in FILE are tokenized, byte by byte and with the vectorized input scanner.\n\n-cache N: Remember the compiled form of up to N recently rolled expressions per thread in interactive and stream modes (default 256, 0 disables). -cache-stats reports hits and misses on stderr at exit.\n\n-macros FILE: Define the macros in FILE (lines of 'name: expression') before doing anything else. Macros can be used by name in any expression (ex. atk+1d4), and defined in interactive mode with 'set macro NAME EXPR'.\n\n-compile FILE -o PLANS: Compile the expressions in FILE (one per line, optionally written 'name: expression') into the plan file PLANS.\n\n-plans PLANS [plan...]: Roll compiled plans from PLANS, chosen by name or by number (from 0), without parsing them again. With no plans given, lists the plans in the file.\n\n-analyze: Describe the distribution of a single expression's result (mean, spread, percentiles). Add -query '>=X' (or >, <=, <, =) for the probability of a result and -percentile P for the Pth percentile. The exact distribution is used when affordable, otherwise a fast approximation with error estimates; -method exact|approx|auto overrides the choice.\n\n-merge FILE...: Combine shard files from the same -sim run into statistics identical to running the whole simulation in one process (-o FILE also writes the merged shard file).\n\nDie modifiers (appended to end of die rolls):\n    c (Usage XdYcZ): Take only the Z highest results from the X dice rolled.\n    v (Usage XdYvZ): Roll 'exploding' dice, wherein if a value at or above Z is rolled on a given die an extra die (of the same Y many sides) is rolled and also added to the total. Such extra dice can also explode given the same threshold.\n    b (Usage XdYbZ): Reroll individual dice that fall below the threshold Z in value until they result in a value greater than Z.\n    w (Usage XdYwZ): Take only the Z lowest results from the X dice rolled.\n    s (Usage XdYsZ): Count the dice that roll Z or higher (successes) instead of summing them.\n    e (Usage XdYeZ): Count successes as with s, but dice that roll their maximum value are rolled again and can add further successes.\n    f (Usage XdYfZ): Count successes as with s, but each die that rolls a 1 cancels one success (the result can be negative).\n\n");
+}
+
+/** Parses option flags, etc out of the start of the input string. */
+ConfigOptions parse_options(int argc, char** argv) {
+  ConfigOptions opts;
+  memset(&opts, 0, sizeof(ConfigOptions));
+  opts.verbosity = VER_DEFAULT;
+  opts.mode = MODE_CMDLINE;
+  opts.shard_index = 1;
+  opts.shard_count = 1;
+  opts.cache_capacity = EXPR_CACHE_DEFAULT_CAPACITY;
+  opts.precision = SIM_UNTIL_DEFAULT_PRECISION;
+  opts.mean_precision = SIM_UNTIL_DEFAULT_MEAN_PRECISION;
+  opts.confidence = SIM_UNTIL_DEFAULT_CONFIDENCE;
+  opts.max_trials = SIM_UNTIL_DEFAULT_MAX_TRIALS;
+  bool verbose = false;
+  bool quiet = false;
+  int i = 1;
+  for (; (i < argc) && (argv[i][0] == '-'); i++) {
+    if (strcmp(argv[i], "-help") == 0) {
+      if (i == 1) {
+        opts.mode = MODE_HELP;
+      } else {
+        print_usage();
+      }
+      return opts;
+    }
+    if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    }
+    if (strcmp(argv[i], "-q") == 0) {
+      quiet = true;
+    }
+    if (strcmp(argv[i], "-i") == 0) {
+      opts.mode = MODE_INTERACTIVE;
+    }
+    if (strcmp(argv[i], "-trace") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      opts.trace_path = argv[++i];
+    }
+    if (strcmp(argv[i], "-sim") == 0) {
+      if (i + 1 >= argc || strspn(argv[i+1], "0123456789") != strlen(argv[i+1]) || argv[i+1][0] == '\0') {
+        print_usage();
+      }
+      opts.mode = MODE_SIM;
+      opts.sim_trials = strtoull(argv[++i], NULL, 10);
+    }
+    if (strcmp(argv[i], "-sim-until") == 0) {
+      opts.mode = MODE_SIM_UNTIL;
+    }
+    if (strcmp(argv[i], "-precision") == 0 || strcmp(argv[i], "-mean-precision") == 0) {
+      if (i + 1 >= argc || atof(argv[i+1]) <= 0) {
+        print_error("-precision and -mean-precision expect a positive number.");
+        print_usage();
+      }
+      if (strcmp(argv[i], "-precision") == 0) {
+        opts.precision = atof(argv[++i]);
+      } else {
+        opts.mean_precision = atof(argv[++i]);
+        opts.mean_precision_set = true;
+      }
+    }
+    if (strcmp(argv[i], "-confidence") == 0) {
+      if (i + 1 >= argc || atof(argv[i+1]) <= 0 || atof(argv[i+1]) >= 1) {
+        print_error("-confidence expects a number between 0 and 1, such as 0.95.");
+        print_usage();
+      }
+      opts.confidence = atof(argv[++i]);
+    }
+    if (strcmp(argv[i], "-max-trials") == 0) {
+      if (i + 1 >= argc || strspn(argv[i+1], "0123456789") != strlen(argv[i+1]) || strtoull(argv[i+1], NULL, 10) == 0) {
+        print_error("-max-trials expects a positive whole number.");
+        print_usage();
+      }
+      opts.max_trials = strtoull(argv[++i], NULL, 10);
+    }
+    if (strcmp(argv[i], "-max-seconds") == 0) {
+      if (i + 1 >= argc || atof(argv[i+1]) <= 0) {
+        print_error("-max-seconds expects a positive number.");
+        print_usage();
+      }
+      opts.max_seconds = atof(argv[++i]);
+    }
+    if (strcmp(argv[i], "-seed") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      opts.seed = strtoull(argv[++i], NULL, 0);
+      opts.seed_set = true;
+    }
+    if (strcmp(argv[i], "-shard") == 0) {
+      if (i + 1 >= argc || sscanf(argv[i+1], "%d/%d", &opts.shard_index, &opts.shard_count) != 2 ||
+          opts.shard_count < 1 || opts.shard_index < 1 || opts.shard_index > opts.shard_count) {
+        print_error("-shard expects i/n with 1 <= i <= n.");
+        print_usage();
+      }
+      i++;
+    }
+    if (strcmp(argv[i], "-o") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      opts.output_path = argv[++i];
+    }
+    if (strcmp(argv[i], "-stream") == 0) {
+      opts.mode = MODE_STREAM;
+    }
+    if (strcmp(argv[i], "-threads") == 0) {
+      if (i + 1 >= argc || atoi(argv[i+1]) < 1) {
+        print_usage();
+      }
+      opts.thread_count = atoi(argv[++i]);
+    }
+    if (strcmp(argv[i], "-compile") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      opts.mode = MODE_COMPILE;
+      opts.input_path = argv[++i];
+    }
+    if (strcmp(argv[i], "-plans") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      opts.mode = MODE_PLANS;
+      opts.plan_path = argv[++i];
+    }
+    if (strcmp(argv[i], "-cache") == 0) {
+      char* end = NULL;
+      long capacity = (i + 1 < argc) ? strtol(argv[i+1], &end, 10) : -1;
+      if (end == NULL || end == argv[i+1] || *end != '\0' || capacity < 0 || capacity > EXPR_CACHE_MAX_CAPACITY) {
+        print_error("-cache expects a whole number from 0 (off) to 1048576.");
+        print_usage();
+      }
+      opts.cache_capacity = (int) capacity;
+      i++;
+    }
+    if (strcmp(argv[i], "-cache-stats") == 0) {
+      opts.cache_stats = true;
+    }
+    if (strcmp(argv[i], "-bench-scan") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      opts.mode = MODE_BENCH_SCAN;
+      opts.input_path = argv[++i];
+    }
+    if (strcmp(argv[i], "-macros") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      opts.macro_path = argv[++i];
+    }
+    if (strcmp(argv[i], "-analyze") == 0) {
+      opts.mode = MODE_ANALYZE;
+    }
+    if (strcmp(argv[i], "-query") == 0) {
+      if (i + 1 >= argc || opts.query_count == MAX_QUERIES) {
+        print_usage();
+      }
+      opts.queries[opts.query_count++] = argv[++i];
+    }
+    if (strcmp(argv[i], "-percentile") == 0) {
+      if (i + 1 >= argc || opts.percentile_count == MAX_QUERIES) {
+        print_usage();
+      }
+      double percentile = atof(argv[++i]);
+      if (percentile <= 0 || percentile > 100) {
+        print_error("-percentile expects a number above 0 and at most 100.");
+        print_usage();
+      }
+      opts.percentiles[opts.percentile_count++] = percentile;
+    }
+    if (strcmp(argv[i], "-method") == 0) {
+      if (i + 1 >= argc) {
+        print_usage();
+      }
+      i++;
+      if (strcmp(argv[i], "exact") == 0) {
+        opts.method = METHOD_EXACT;
+      } else if (strcmp(argv[i], "approx") == 0) {
+        opts.method = METHOD_APPROX;
+      } else if (strcmp(argv[i], "auto") == 0) {
+        opts.method = METHOD_AUTO;
+      } else {
+        print_error("-method expects exact, approx or auto.");
+        print_usage();
+      }
+    }
+    if (strcmp(argv[i], "-merge") == 0) {
+      opts.mode = MODE_MERGE;
+    }
+  }
+  if (verbose && quiet) {
+    verbose = false;
+    quiet = false;
+  }
+  if (verbose) {
+    opts.verbosity = VER_VERBOSE;
+  }
+  if (quiet) {
+    opts.verbosity = VER_QUIET;
+  }
+  opts.option_count = i-1;
+  return opts;
+}
+
+/** Parses a query such as ">=15", "<3" or "=10" into 'query'. Returns false if it is not one. */
+bool parse_query(char* text, ResultQuery* query) {
+  int skip = 1;
+  if (strncmp(text, ">=", 2) == 0) {
+    query->op = QUERY_GE;
+    skip = 2;
+  } else if (strncmp(text, "<=", 2) == 0) {
+    query->op = QUERY_LE;
+    skip = 2;
+  } else if (strncmp(text, "==", 2) == 0) {
+    query->op = QUERY_EQ;
+    skip = 2;
+  } else if (text[0] == '>') {
+    query->op = QUERY_GT;
+  } else if (text[0] == '<') {
+    query->op = QUERY_LT;
+  } else if (text[0] == '=') {
+    query->op = QUERY_EQ;
+  } else {
+    return false;
+  }
+  char* end;
+  long value = strtol(text + skip, &end, 10);
+  if (end == text + skip || *end != '\0') {
+    return false;
+  }
+  query->value = (int) value;
+  return true;
+}
+
+/** Returns the comparison a query makes, for output. */
+const char* query_op_text(QueryOp op) {
+  switch (op) {
+  case QUERY_LT:
+    return "<";
+  case QUERY_LE:
+    return "<=";
+  case QUERY_EQ:
+    return "=";
+  case QUERY_GE:
+    return ">=";
+  case QUERY_GT:
+  default:
+    return ">";
+  }
+}
+
+/** Returns the greatest common divisor of two non-negative numbers (gcd(0, x) is x). */
+long long gcd_ll(long long a, long long b) {
+  while (b != 0) {
+    long long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/** Returns 1^m + 2^m + ... + n^m, for m from 0 to 4. */
+long double power_sum(int m, long double n) {
+  if (n <= 0) {
+    return 0;
+  }
+  switch (m) {
+  case 0:
+    return n;
+  case 1:
+    return n * (n + 1) / 2;
+  case 2:
+    return n * (n + 1) * (2 * n + 1) / 6;
+  case 3:
+    return (n * (n + 1) / 2) * (n * (n + 1) / 2);
+  default:
+    return n * (n + 1) * (2 * n + 1) * (3 * n * n + 3 * n - 1) / 30;
+  }
+}
+
+/** Converts raw moments m[1..4] into the cumulants of 'c' (leaving its other fields alone). */
+void cumulants_from_raw(const long double* m, Cumulants* c) {
+  long double m1 = m[1], m2 = m[2], m3 = m[3], m4 = m[4];
+  c->k[0] = 0;
+  c->k[1] = m1;
+  c->k[2] = m2 - m1 * m1;
+  c->k[3] = m3 - 3 * m2 * m1 + 2 * m1 * m1 * m1;
+  c->k[4] = m4 - 4 * m3 * m1 - 3 * m2 * m2 + 12 * m2 * m1 * m1 - 6 * m1 * m1 * m1 * m1;
+}
+
+/** Converts cumulants into raw moments m[0..4]. */
+void raw_from_cumulants(const Cumulants* c, long double* m) {
+  long double k1 = c->k[1], k2 = c->k[2], k3 = c->k[3], k4 = c->k[4];
+  m[0] = 1;
+  m[1] = k1;
+  m[2] = k2 + k1 * k1;
+  m[3] = k3 + 3 * k2 * k1 + k1 * k1 * k1;
+  m[4] = k4 + 4 * k3 * k1 + 3 * k2 * k2 + 6 * k2 * k1 * k1 + k1 * k1 * k1 * k1;
+}
+
+/** Returns the cumulants of a constant. */
+Cumulants constant_cumulants(long long value) {
+  Cumulants c;
+  memset(&c, 0, sizeof(Cumulants));
+  c.k[1] = (double) value;
+  c.base = value;
+  return c;
+}
+
+/** Returns the cumulants of a single value with the given raw moments m[0..4], on the integer lattice. */
+Cumulants die_cumulants(const long double* m) {
+  Cumulants c;
+  memset(&c, 0, sizeof(Cumulants));
+  cumulants_from_raw(m, &c);
+  c.span = 1;
+  return c;
+}
+
+/** Turns the cumulants of one die into those of the sum of 'n' independent such dice. */
+Cumulants sum_of_iid(Cumulants die, int n) {
+  for (int j = 1; j <= 4; j++) {
+    die.k[j] *= n;
+  }
+  die.mean_err *= n;
+  die.sd_err *= sqrt((double) n);
+  die.base *= n;
+  if (n == 0) {
+    die.span = 0;
+  }
+  return die;
+}
+
+/** Computes the raw moments T[0..4] of an exploding chain T = V + I * T', where V is one roll's value,
+ *  I says whether that roll explodes and T' is an independent copy of T. A[m] = E[V^m] and
+ *  B[m] = E[V^m I], so B[0] is the chance of exploding, which must be below 1. */
+void chain_raw_moments(const long double* A, const long double* B, long double* T) {
+  static const int binom[5][5] = { {1}, {1, 1}, {1, 2, 1}, {1, 3, 3, 1}, {1, 4, 6, 4, 1} };
+  T[0] = 1;
+  for (int k = 1; k <= 4; k++) {
+    long double sum = A[k];
+    for (int j = 1; j < k; j++) {
+      sum += binom[k][j] * B[k - j] * T[j];
+    }
+    T[k] = sum / (1 - B[0]);
+  }
+}
+
+/** Returns the mean of the total of the 'keep' highest of 'n' dice with 'sides' sides, as the sum over
+ *  faces f of E[min(keep, number of dice showing f or more)]. Takes O(sides * keep) time. */
+double choose_high_mean(int n, int sides, int keep) {
+  double mean = 0;
+  for (int f = 1; f <= sides; f++) {
+    double p = (sides - f + 1) / (double) sides;
+    // E[min(keep, N)] = keep - sum over j < keep of (keep - j) P(N = j), with N ~ Binomial(n, p)
+    double shortfall = 0;
+    if (p < 1.0) {
+      for (int j = 0; j < keep; j++) {
+        double logpmf = lgamma(n + 1.0) - lgamma(j + 1.0) - lgamma(n - j + 1.0) + j * log(p) + (n - j) * log1p(-p);
+        shortfall += (keep - j) * exp(logpmf);
+      }
+    }
+    mean += keep - shortfall;
+  }
+  return mean;
+}
+
+/** Returns the estimated cost of choose_high_distribution. */
+double choose_dp_cost(double n, double sides, double keep) {
+  return sides * n * n / 2 * (keep * sides + 1);
+}
+
+bool choose_high_distribution(int n, int sides, int keep, Distribution* out);
+
+/** Propagates cumulants through a 'keep highest' roll (keep lowest is its mirror image). Small rolls are
+ *  done exactly from their distribution. Large ones use the identity that the sum of the 'keep' highest
+ *  of X_1..X_n is the minimum over t of keep*t + sum (X_i - t)^+, which for large pools is close to its
+ *  value at the population quantile t = xi, a sum of independent terms. */
+bool choose_high_cumulants(int n, int sides, int keep, Cumulants* out) {
+  if (choose_dp_cost(n, sides, keep) <= EXACT_COST_LIMIT) {
+    Distribution dist;
+    if (!choose_high_distribution(n, sides, keep, &dist)) {
+      return false;
+    }
+    long double m[5] = { 1, 0, 0, 0, 0 };
+    for (long long i = 0; i < dist.len; i++) {
+      long double x = dist.lo + i;
+      m[1] += dist.p[i] * x;
+      m[2] += dist.p[i] * x * x;
+      m[3] += dist.p[i] * x * x * x;
+      m[4] += dist.p[i] * x * x * x * x;
+    }
+    free_distribution(&dist);
+    *out = die_cumulants(m);
+    return true;
+  }
+  double frac = keep / (double) n;
+  long long xi = (long long) ceil(sides - frac * sides);
+  xi = xi < 0 ? 0 : (xi > sides ? sides : xi);
+  long double y[5];
+  y[0] = 1;
+  for (int m = 1; m <= 4; m++) {
+    y[m] = power_sum(m, sides - xi) / sides;
+  }
+  *out = sum_of_iid(die_cumulants(y), n);
+  out->k[1] += (double) keep * xi;
+  int smaller = keep < n - keep ? keep : n - keep;
+  out->sd_err = sqrt(out->k[2]) / sqrt(smaller + 1.0);
+  if ((double) sides * keep <= 1e7) {
+    out->k[1] = choose_high_mean(n, sides, keep);
+    out->mean_err = 0;
+  } else {
+    out->mean_err = out->sd_err;
+  }
+  return true;
+}
+
+/** Computes the cumulants of one roll node, or reports why it has none (it would never finish). */
+bool roll_cumulants(RollNode* roll, Cumulants* out) {
+  int n = roll->dieCount;
+  int sides = roll->dieSides;
+  ModifierType type = (roll->rollMod != NULL) ? roll->rollMod->type : NONE;
+  int c = (roll->rollMod != NULL) ? roll->rollMod->constant : 0;
+  long double m[5];
+  Cumulants die;
+  memset(&die, 0, sizeof(Cumulants));
+  die.span = 1;
+
+  switch (type) {
+  case NONE:
+  case REROLL_BELOW: {
+    long double a = (type == REROLL_BELOW && c >= 1) ? c + 1 : 1;
+    long double w = sides - a + 1;
+    if (w <= 0) {
+      print_error("Roll rerolls every result and never finishes.");
+      return false;
+    }
+    die.k[1] = (a + sides) / 2;
+    die.k[2] = (w * w - 1) / 12;
+    die.k[4] = -(w * w - 1) * (w * w + 1) / 120;
+    break;
+  }
+  case KEEP_AND_REROLL_ABOVE: {
+    long double A[5], B[5];
+    int low = c < 1 ? 1 : c;
+    for (int j = 0; j <= 4; j++) {
+      A[j] = power_sum(j, sides) / sides;
+      B[j] = (low <= sides) ? (power_sum(j, sides) - power_sum(j, low - 1)) / sides : 0;
+    }
+    if (B[0] >= 1) {
+      print_error("Roll explodes on every result and never finishes.");
+      return false;
+    }
+    chain_raw_moments(A, B, m);
+    die = die_cumulants(m);
+    break;
+  }
+  case COUNT_SUCCESSES: {
+    double p = count_faces_between(sides, c, sides) / (double) sides;
+    die.k[1] = p;
+    die.k[2] = p * (1 - p);
+    die.k[3] = p * (1 - p) * (1 - 2 * p);
+    die.k[4] = p * (1 - p) * (1 - 6 * p * (1 - p));
+    break;
+  }
+  case COUNT_SUCCESSES_ONES_CANCEL: {
+    long double plus = count_faces_between(sides, c > 2 ? c : 2, sides) / (long double) sides;
+    long double minus = (c > 1) ? 1.0L / sides : 0;
+    m[0] = 1;
+    for (int j = 1; j <= 4; j++) {
+      m[j] = (j % 2) ? plus - minus : plus + minus;
+    }
+    die = die_cumulants(m);
+    break;
+  }
+  case COUNT_EXPLODING_SUCCESSES: {
+    if (sides <= 1) {
+      print_error("Roll explodes on every result and never finishes.");
+      return false;
+    }
+    long double A[5], B[5];
+    A[0] = 1;
+    B[0] = 1.0L / sides;
+    for (int j = 1; j <= 4; j++) {
+      A[j] = count_faces_between(sides, c, sides) / (long double) sides;
+      B[j] = (c <= sides) ? 1.0L / sides : 0;
+    }
+    chain_raw_moments(A, B, m);
+    die = die_cumulants(m);
+    break;
+  }
+  case CHOOSE_HIGH:
+  case CHOOSE_LOW: {
+    if (c <= 0) {
+      *out = constant_cumulants(0);
+      return true;
+    }
+    if (c >= n) {
+      die.k[1] = (1.0 + sides) / 2;
+      die.k[2] = ((double) sides * sides - 1) / 12;
+      die.k[4] = -((double) sides * sides - 1) * ((double) sides * sides + 1) / 120;
+      *out = sum_of_iid(die, n);
+      return true;
+    }
+    if (!choose_high_cumulants(n, sides, c, out)) {
+      return false;
+    }
+    if (type == CHOOSE_LOW) {
+      // The lowest c of n dice are (sides + 1) * c minus the highest c of the mirrored dice.
+      out->k[1] = (double) (sides + 1) * c - out->k[1];
+      out->k[3] = -out->k[3];
+    }
+    return true;
+  }
+  }
+  *out = sum_of_iid(die, n);
+  return true;
+}
+
+/** Combines the cumulants of two independent results under an arithmetic operation. */
+bool combine_cumulants(Cumulants* a, Cumulants* b, Operation opt, Cumulants* out) {
+  memset(out, 0, sizeof(Cumulants));
+  double sda = sqrt(a->k[2] > 0 ? a->k[2] : 0);
+  double sdb = sqrt(b->k[2] > 0 ? b->k[2] : 0);
+  switch (opt) {
+  case PLUS:
+  case MINUS: {
+    int sign = (opt == PLUS) ? 1 : -1;
+    out->k[1] = a->k[1] + sign * b->k[1];
+    out->k[2] = a->k[2] + b->k[2];
+    out->k[3] = a->k[3] + sign * b->k[3];
+    out->k[4] = a->k[4] + b->k[4];
+    out->mean_err = a->mean_err + b->mean_err;
+    out->sd_err = sqrt(a->sd_err * a->sd_err + b->sd_err * b->sd_err);
+    out->span = gcd_ll(a->span, b->span);
+    out->base = a->base + sign * b->base;
+    return true;
+  }
+  case TIMES: {
+    long double ma[5], mb[5], m[5];
+    raw_from_cumulants(a, ma);
+    raw_from_cumulants(b, mb);
+    for (int j = 0; j <= 4; j++) {
+      m[j] = ma[j] * mb[j];
+    }
+    cumulants_from_raw(m, out);
+    out->mean_err = fabs(a->k[1]) * b->mean_err + fabs(b->k[1]) * a->mean_err;
+    double sd = sqrt(out->k[2] > 0 ? out->k[2] : 0);
+    out->sd_err = sd * ((sda > 0 ? a->sd_err / sda : 0) + (sdb > 0 ? b->sd_err / sdb : 0));
+    if (a->span == 0 || b->span == 0) {
+      Cumulants* constant = (a->span == 0) ? a : b;
+      Cumulants* other = (a->span == 0) ? b : a;
+      out->span = llabs(constant->base) * other->span;
+      out->base = constant->base * other->base;
+    } else {
+      out->span = 1;
+    }
+    return true;
+  }
+  case DIVIDE:
+    if (b->span == 0) {
+      long long divisor = b->base;
+      if (divisor == 0) {
+        print_error("Division by zero.");
+        return false;
+      }
+      if (a->span == 0) {
+        *out = constant_cumulants(a->base / divisor);
+        return true;
+      }
+      double d = (double) divisor;
+      out->k[1] = a->k[1] / d;
+      out->k[2] = a->k[2] / (d * d);
+      out->k[3] = a->k[3] / (d * d * d);
+      out->k[4] = a->k[4] / (d * d * d * d);
+      // Integer division truncates, which shifts the mean by up to 1/2 and the spread slightly.
+      out->mean_err = a->mean_err / fabs(d) + 0.5;
+      out->sd_err = a->sd_err / fabs(d) + 0.5;
+      out->span = 1;
+      return true;
+    }
+    if (fabs(b->k[1]) <= 3 * sdb) {
+      print_error("Cannot approximate division by a result that is often near zero.");
+      return false;
+    }
+    // Delta method: only the first two cumulants of a ratio are approximated.
+    out->k[1] = a->k[1] / b->k[1];
+    out->k[2] = (a->k[2] + out->k[1] * out->k[1] * b->k[2]) / (b->k[1] * b->k[1]);
+    out->mean_err = 0.5 + fabs(out->k[1]) * b->k[2] / (b->k[1] * b->k[1]) + a->mean_err / fabs(b->k[1]);
+    out->sd_err = 0.25 * sqrt(out->k[2]) + 0.5;
+    out->span = 1;
+    return true;
+  default:
+    print_error("Unrecognized operation.");
+    return false;
+  }
+}
+
+/** Computes the cumulants of an object node. */
+bool obj_cumulants(ObjNode* obj, Cumulants* out) {
+  if (obj->roll != NULL) {
+    return roll_cumulants(obj->roll, out);
+  } else if (obj->subList != NULL) {
+    return expr_cumulants(obj->subList, out);
+  } else if (obj->macro >= 0) {
+    return expr_cumulants(get_macro_tree(obj->macro), out);
+  }
+  *out = constant_cumulants(obj->constant);
+  return true;
+}
+
+/** Propagates the first four cumulants of the result through a parse tree analytically, in time
+ *  proportional to its size (rolls keeping the highest/lowest dice excepted while they are small
+ *  enough to do exactly). Sub-results are independent, so sums and differences add cumulants and
+ *  products multiply raw moments; division by a random result is only approximated. */
+bool expr_cumulants(ExprList* expr, Cumulants* out) {
+  Cumulants lhs;
+  bool ok = (expr->lhList != NULL) ? expr_cumulants(expr->lhList, &lhs) : obj_cumulants(expr->obj, &lhs);
+  if (!ok) {
+    return false;
+  }
+  if (expr_is_singlet(expr)) {
+    *out = lhs;
+    return true;
+  }
+  Cumulants rhs;
+  if (!expr_cumulants(expr->rhList, &rhs)) {
+    return false;
+  }
+  return combine_cumulants(&lhs, &rhs, expr->opt, out);
+}
+
+/** Allocates a distribution over lo .. lo+len-1 with all probabilities zero. */
+bool dist_alloc(Distribution* dist, long long lo, long long len) {
+  dist->lo = lo;
+  dist->len = len;
+  dist->p = calloc(len, sizeof(double));
+  if (dist->p == NULL) {
+    print_error("Out of memory.");
+    return false;
+  }
+  return true;
+}
+
+/** Frees the probabilities held by a distribution. */
+void free_distribution(Distribution* dist) {
+  free(dist->p);
+  dist->p = NULL;
+  dist->len = 0;
+}
+
+/** Computes the distribution of a + sign * b for independent a and b. */
+bool dist_convolve(Distribution* a, Distribution* b, int sign, Distribution* out) {
+  long long lo = (sign > 0) ? a->lo + b->lo : a->lo - (b->lo + b->len - 1);
+  if (!dist_alloc(out, lo, a->len + b->len - 1)) {
+    return false;
+  }
+  for (long long i = 0; i < a->len; i++) {
+    if (a->p[i] == 0) {
+      continue;
+    }
+    for (long long j = 0; j < b->len; j++) {
+      long long offset = (sign > 0) ? i + j : i + (b->len - 1 - j);
+      out->p[offset] += a->p[i] * b->p[j];
+    }
+  }
+  return true;
+}
+
+/** Computes the distribution of a * b or a / b for independent a and b, value pair by value pair. */
+bool dist_combine(Distribution* a, Distribution* b, Operation opt, Distribution* out) {
+  long long alo = a->lo, ahi = a->lo + a->len - 1, blo = b->lo, bhi = b->lo + b->len - 1;
+  long long lo, hi;
+  if (opt == TIMES) {
+    long long corners[4] = { alo * blo, alo * bhi, ahi * blo, ahi * bhi };
+    lo = hi = corners[0];
+    for (int i = 1; i < 4; i++) {
+      lo = corners[i] < lo ? corners[i] : lo;
+      hi = corners[i] > hi ? corners[i] : hi;
+    }
+  } else {
+    if (blo <= 0 && bhi >= 0 && b->p[-blo] > 0) {
+      print_error("Division by zero is possible.");
+      return false;
+    }
+    long long reach = llabs(alo) > llabs(ahi) ? llabs(alo) : llabs(ahi);
+    lo = -reach;
+    hi = reach;
+  }
+  if (!dist_alloc(out, lo, hi - lo + 1)) {
+    return false;
+  }
+  for (long long i = 0; i < a->len; i++) {
+    if (a->p[i] == 0) {
+      continue;
+    }
+    for (long long j = 0; j < b->len; j++) {
+      if (b->p[j] == 0) {
+        continue;
+      }
+      long long x = a->lo + i, y = b->lo + j;
+      long long r = (opt == TIMES) ? x * y : x / y;
+      out->p[r - lo] += a->p[i] * b->p[j];
+    }
+  }
+  return true;
+}
+
+/** Computes the distribution of the sum of n independent copies of 'die'. */
+bool dist_iid_sum(Distribution* die, int n, Distribution* out) {
+  if (!dist_alloc(out, 0, 1)) {
+    return false;
+  }
+  out->p[0] = 1;
+  for (int i = 0; i < n; i++) {
+    Distribution next;
+    if (!dist_convolve(out, die, 1, &next)) {
+      free_distribution(out);
+      return false;
+    }
+    free_distribution(out);
+    *out = next;
+  }
+  return true;
+}
+
+/** Computes the distribution of the sum of n dice uniform on a .. b, adding one die at a time
+ *  with a sliding window so each die costs time proportional to the support so far. */
+bool dist_uniform_sum(int n, int a, int b, Distribution* out) {
+  long long w = b - a + 1;
+  if (!dist_alloc(out, (long long) n * a, (long long) n * (w - 1) + 1)) {
+    return false;
+  }
+  out->p[0] = 1;
+  double* next = malloc(sizeof(double) * out->len);
+  if (next == NULL) {
+    free_distribution(out);
+    print_error("Out of memory.");
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    long long used = (long long) i * (w - 1) + 1;
+    double window = 0;
+    for (long long x = 0; x < used + w - 1; x++) {
+      window += (x < used) ? out->p[x] : 0;
+      window -= (x - w >= 0 && x - w < used) ? out->p[x - w] : 0;
+      next[x] = window / w;
+    }
+    memcpy(out->p, next, sizeof(double) * (used + w - 1));
+  }
+  free(next);
+  return true;
+}
+
+/** Computes the exact distribution of the total of the 'keep' highest of n dice with 'sides' sides.
+ *  Faces are visited from highest to lowest, tracking how many dice have been given a face so far and
+ *  the total kept so far; giving m of the remaining dice the current face has weight C(remaining, m) / sides^m. */
+bool choose_high_distribution(int n, int sides, int keep, Distribution* out) {
+  long long sums = (long long) keep * sides + 1;
+  double* dp = calloc((size_t) (n + 1) * sums, sizeof(double));
+  double* next = calloc((size_t) (n + 1) * sums, sizeof(double));
+  if (dp == NULL || next == NULL) {
+    free(dp);
+    free(next);
+    print_error("Out of memory.");
+    return false;
+  }
+  dp[0] = 1;
+  for (int f = sides; f >= 1; f--) {
+    memset(next, 0, sizeof(double) * (n + 1) * sums);
+    for (int j = 0; j <= n; j++) {
+      int slots = keep - j > 0 ? keep - j : 0;
+      for (long long sum = 0; sum < sums; sum++) {
+        double p = dp[j * sums + sum];
+        if (p == 0) {
+          continue;
+        }
+        double weight = 1;
+        for (int m = 0; m <= n - j; m++) {
+          int kept = m < slots ? m : slots;
+          next[(j + m) * sums + sum + (long long) kept * f] += p * weight;
+          weight *= (double) (n - j - m) / ((m + 1) * (double) sides);
+        }
+      }
+    }
+    double* swap = dp;
+    dp = next;
+    next = swap;
+  }
+  bool ok = dist_alloc(out, 0, sums);
+  if (ok) {
+    memcpy(out->p, dp + (size_t) n * sums, sizeof(double) * sums);
+  }
+  free(dp);
+  free(next);
+  return ok;
+}
+
+/** Returns the number of explosions after which a chain exploding with probability q has less than
+ *  EXPLODE_TAIL_EPSILON chance of still going (or INFINITY if it never stops). */
+double explosion_chain_limit(double q) {
+  if (q <= 0) {
+    return 1;
+  }
+  if (q >= 1) {
+    return INFINITY;
+  }
+  return ceil(log(EXPLODE_TAIL_EPSILON) / log(q)) + 1;
+}
+
+/** Computes the exact distribution of one roll node. Exploding rolls are truncated where their
+ *  remaining probability falls below EXPLODE_TAIL_EPSILON. */
+bool roll_distribution(RollNode* roll, Distribution* out) {
+  int n = roll->dieCount;
+  int sides = roll->dieSides;
+  ModifierType type = (roll->rollMod != NULL) ? roll->rollMod->type : NONE;
+  int c = (roll->rollMod != NULL) ? roll->rollMod->constant : 0;
+  Distribution die;
+  bool ok;
+
+  switch (type) {
+  case NONE:
+    return dist_uniform_sum(n, 1, sides, out);
+  case REROLL_BELOW:
+    if (c >= sides) {
+      print_error("Roll rerolls every result and never finishes.");
+      return false;
+    }
+    return dist_uniform_sum(n, c >= 1 ? c + 1 : 1, sides, out);
+  case COUNT_SUCCESSES: {
+    double p = count_faces_between(sides, c, sides) / (double) sides;
+    if (!dist_alloc(out, 0, (long long) n + 1)) {
+      return false;
+    }
+    for (int j = 0; j <= n; j++) {
+      if (p <= 0 || p >= 1) {
+        out->p[j] = (j == (p >= 1 ? n : 0)) ? 1 : 0;
+      } else {
+        out->p[j] = exp(lgamma(n + 1.0) - lgamma(j + 1.0) - lgamma(n - j + 1.0) + j * log(p) + (n - j) * log1p(-p));
+      }
+    }
+    return true;
+  }
+  case COUNT_SUCCESSES_ONES_CANCEL:
+    if (!dist_alloc(&die, -1, 3)) {
+      return false;
+    }
+    die.p[2] = count_faces_between(sides, c > 2 ? c : 2, sides) / (double) sides;
+    die.p[0] = (c > 1) ? 1.0 / sides : 0;
+    die.p[1] = 1 - die.p[0] - die.p[2];
+    break;
+  case KEEP_AND_REROLL_ABOVE: {
+    int low = c < 1 ? 1 : c;
+    double limit = explosion_chain_limit(count_faces_between(sides, low, sides) / (double) sides);
+    if (isinf(limit)) {
+      print_error("Roll explodes on every result and never finishes.");
+      return false;
+    }
+    long long len = (long long) (limit * sides) + 1;
+    if (!dist_alloc(&die, 0, len)) {
+      return false;
+    }
+    // P(T = t) = P(first roll is t and does not explode) + sum over exploding r of P(r) P(T = t - r).
+    for (long long t = 1; t < len; t++) {
+      double p = (t < low && t <= sides) ? 1.0 / sides : 0;
+      for (int r = low; r <= sides && r < t; r++) {
+        p += die.p[t - r] / sides;
+      }
+      die.p[t] = p;
+    }
+    break;
+  }
+  case COUNT_EXPLODING_SUCCESSES: {
+    if (sides <= 1) {
+      print_error("Roll explodes on every result and never finishes.");
+      return false;
+    }
+    long long len = (long long) explosion_chain_limit(1.0 / sides) + 2;
+    if (!dist_alloc(&die, 0, len)) {
+      return false;
+    }
+    double fail = count_faces_between(sides, 1, (c - 1 < sides - 1) ? c - 1 : sides - 1) / (double) sides;
+    double success = count_faces_between(sides, c, sides - 1) / (double) sides;
+    if (c > sides) {
+      die.p[0] = 1;
+    } else {
+      die.p[0] = fail;
+      for (long long t = 1; t < len; t++) {
+        die.p[t] = ((t == 1) ? success : 0) + die.p[t - 1] / sides;
+      }
+    }
+    break;
+  }
+  case CHOOSE_HIGH:
+  case CHOOSE_LOW:
+  default:
+    if (c <= 0) {
+      if (!dist_alloc(out, 0, 1)) {
+        return false;
+      }
+      out->p[0] = 1;
+      return true;
+    }
+    if (c >= n) {
+      return dist_uniform_sum(n, 1, sides, out);
+    }
+    if (!choose_high_distribution(n, sides, c, out)) {
+      return false;
+    }
+    if (type == CHOOSE_LOW) {
+      // The lowest c of n dice are (sides + 1) * c minus the highest c of the mirrored dice.
+      for (long long i = 0; i < out->len / 2; i++) {
+        double swap = out->p[i];
+        out->p[i] = out->p[out->len - 1 - i];
+        out->p[out->len - 1 - i] = swap;
+      }
+      out->lo = (long long) (sides + 1) * c - (out->lo + out->len - 1);
+    }
+    return true;
+  }
+  ok = dist_iid_sum(&die, n, out);
+  free_distribution(&die);
+  return ok;
+}
+
+/** Computes the exact distribution of an object node. */
+bool obj_distribution(ObjNode* obj, Distribution* out) {
+  if (obj->roll != NULL) {
+    return roll_distribution(obj->roll, out);
+  } else if (obj->subList != NULL) {
+    return expr_distribution(obj->subList, out);
+  } else if (obj->macro >= 0) {
+    return expr_distribution(get_macro_tree(obj->macro), out);
+  }
+  if (!dist_alloc(out, obj->constant, 1)) {
+    return false;
+  }
+  out->p[0] = 1;
+  return true;
+}
+
+/** Computes the exact distribution of the result of a parse tree by convolving the distributions of
+ *  its independent parts. Check estimate_exact_cost first: this can be very expensive. */
+bool expr_distribution(ExprList* expr, Distribution* out) {
+  Distribution lhs;
+  bool ok = (expr->lhList != NULL) ? expr_distribution(expr->lhList, &lhs) : obj_distribution(expr->obj, &lhs);
+  if (!ok || expr_is_singlet(expr)) {
+    *out = lhs;
+    return ok;
+  }
+  Distribution rhs;
+  if (!expr_distribution(expr->rhList, &rhs)) {
+    free_distribution(&lhs);
+    return false;
+  }
+  switch (expr->opt) {
+  case PLUS:
+    ok = dist_convolve(&lhs, &rhs, 1, out);
+    break;
+  case MINUS:
+    ok = dist_convolve(&lhs, &rhs, -1, out);
+    break;
+  default:
+    ok = dist_combine(&lhs, &rhs, expr->opt, out);
+    break;
+  }
+  free_distribution(&lhs);
+  free_distribution(&rhs);
+  return ok;
+}
+
+/** Estimates the cost (in basic operations) of computing a roll node's exact distribution, and its range. */
+double estimate_roll_cost(RollNode* roll, double* lo, double* hi) {
+  double n = roll->dieCount;
+  double sides = roll->dieSides;
+  ModifierType type = (roll->rollMod != NULL) ? roll->rollMod->type : NONE;
+  double c = (roll->rollMod != NULL) ? roll->rollMod->constant : 0;
+  switch (type) {
+  case REROLL_BELOW: {
+    double w = sides - (c > 0 ? c : 0);
+    if (w <= 0) {
+      return INFINITY;
+    }
+    *lo = n * (sides - w + 1);
+    *hi = n * sides;
+    return n * n * w / 2 + 1;
+  }
+  case KEEP_AND_REROLL_ABOVE: {
+    double len = explosion_chain_limit(count_faces_between(roll->dieSides, c < 1 ? 1 : c, roll->dieSides) / sides) * sides;
+    *lo = n;
+    *hi = n * len;
+    return len * sides + n * n * len * len / 2 + 1;
+  }
+  case COUNT_SUCCESSES:
+    *lo = 0;
+    *hi = n;
+    return n + 1;
+  case COUNT_SUCCESSES_ONES_CANCEL:
+    *lo = -n;
+    *hi = n;
+    return n * n * 3 + 1;
+  case COUNT_EXPLODING_SUCCESSES: {
+    double len = (sides > 1) ? explosion_chain_limit(1.0 / sides) + 2 : INFINITY;
+    *lo = 0;
+    *hi = n * len;
+    return n * n * len * len / 2 + 1;
+  }
+  case CHOOSE_HIGH:
+  case CHOOSE_LOW:
+    if (c <= 0) {
+      *lo = *hi = 0;
+      return 1;
+    }
+    if (c < n) {
+      *lo = c;
+      *hi = c * sides;
+      return choose_dp_cost(n, sides, c);
+    }
+    // Keeping every die is a plain roll.
+    /* fallthrough */
+  case NONE:
+  default:
+    *lo = n;
+    *hi = n * sides;
+    return n * n * sides / 2 + 1;
+  }
+}
+
+/** Estimates the cost of computing an object node's exact distribution, and its range. */
+double estimate_obj_cost(ObjNode* obj, double* lo, double* hi) {
+  if (obj->roll != NULL) {
+    return estimate_roll_cost(obj->roll, lo, hi);
+  } else if (obj->subList != NULL) {
+    return estimate_exact_cost(obj->subList, lo, hi);
+  } else if (obj->macro >= 0) {
+    return estimate_exact_cost(get_macro_tree(obj->macro), lo, hi);
+  }
+  *lo = *hi = obj->constant;
+  return 1;
+}
+
+/** Estimates, in time proportional to the size of the tree, how many operations expr_distribution
+ *  would take and the range of results it would cover. Returns INFINITY if it is not feasible. */
+double estimate_exact_cost(ExprList* expr, double* lo, double* hi) {
+  double cost = (expr->lhList != NULL) ? estimate_exact_cost(expr->lhList, lo, hi) : estimate_obj_cost(expr->obj, lo, hi);
+  if (expr_is_singlet(expr)) {
+    return cost;
+  }
+  double rlo, rhi;
+  cost += estimate_exact_cost(expr->rhList, &rlo, &rhi);
+  double llen = *hi - *lo + 1, rlen = rhi - rlo + 1;
+  switch (expr->opt) {
+  case PLUS:
+    *lo += rlo;
+    *hi += rhi;
+    break;
+  case MINUS: {
+    double l = *lo - rhi;
+    *hi = *hi - rlo;
+    *lo = l;
+    break;
+  }
+  case TIMES: {
+    double corners[4] = { *lo * rlo, *lo * rhi, *hi * rlo, *hi * rhi };
+    *lo = *hi = corners[0];
+    for (int i = 1; i < 4; i++) {
+      *lo = corners[i] < *lo ? corners[i] : *lo;
+      *hi = corners[i] > *hi ? corners[i] : *hi;
+    }
+    break;
+  }
+  default: {
+    double reach = fabs(*lo) > fabs(*hi) ? fabs(*lo) : fabs(*hi);
+    *lo = -reach;
+    *hi = reach;
+    break;
+  }
+  }
+  cost += llen * rlen + (*hi - *lo + 1);
+  // Results must fit in an int and their distribution in memory.
+  if (*hi - *lo + 1 > 1e9 || *lo < -2147483648.0 || *hi > 2147483647.0) {
+    return INFINITY;
+  }
+  return cost;
+}
+
+/** Returns the standard normal density at z. */
+double normal_pdf(double z) {
+  return exp(-z * z / 2) / sqrt(2 * 3.14159265358979323846);
+}
+
+/** Approximates P(result <= x) from cumulants with a one-term Edgeworth expansion (skewness and
+ *  kurtosis corrections to the normal) and a continuity correction for the lattice the result lies
+ *  on. 'err' receives an error estimate: the size of both correction terms and of the next order's
+ *  terms (which, unlike the corrections applied, can be as large as the error when the result is far
+ *  from normal), plus the effect of any uncertainty in the cumulants themselves. Outside the range of
+ *  possible results the answer is exact. */
+double edgeworth_cdf(Cumulants* c, double x, double* err) {
+  double sd = sqrt(c->k[2] > 0 ? c->k[2] : 0);
+  if (c->span == 0 || sd == 0) {
+    *err = 0;
+    return (x >= c->k[1]) ? 1 : 0;
+  }
+  if (x < c->lo || x >= c->hi) {
+    // Outside the range of possible results the answer is certain, whatever the expansion says.
+    *err = 0;
+    return (x < c->lo) ? 0 : 1;
+  }
+  double h = (double) c->span;
+  double snapped = c->base + h * floor((x - c->base) / h);
+  double z = (snapped + h / 2 - c->k[1]) / sd;
+  double g1 = c->k[3] / (sd * sd * sd);
+  double g2 = c->k[4] / (sd * sd * sd * sd);
+  double phi = normal_pdf(z);
+  double first = g1 / 6 * (z * z - 1);
+  double second = g2 / 24 * (z * z * z - 3 * z) + g1 * g1 / 72 * (z * z * z * z * z - 10 * z * z * z + 15 * z);
+  double cdf = 0.5 * erfc(-z / sqrt(2.0)) - phi * (first + second);
+  double z2 = z * z;
+  double he6 = ((z2 - 15) * z2 + 45) * z2 - 15;
+  double he7 = (((z2 - 21) * z2 + 105) * z2 - 105) * z;
+  double he8 = (((z2 - 28) * z2 + 210) * z2 - 420) * z2 + 105;
+  double third = fabs(g1 * g2) / 144 * fabs(he6) + fabs(g1 * g1 * g1) / 1296 * fabs(he8) + g2 * g2 / 1152 * fabs(he7);
+  *err = phi * (fabs(first) + fabs(second) + third + fabs(z) * c->sd_err / sd + c->mean_err / sd) + EDGEWORTH_SKEW_ERR * fabs(g1);
+  return cdf < 0 ? 0 : (cdf > 1 ? 1 : cdf);
+}
+
+/** Returns whether result 'x' satisfies a query. */
+bool query_matches(ResultQuery* query, long long x) {
+  switch (query->op) {
+  case QUERY_LT:
+    return x < query->value;
+  case QUERY_LE:
+    return x <= query->value;
+  case QUERY_EQ:
+    return x == query->value;
+  case QUERY_GE:
+    return x >= query->value;
+  case QUERY_GT:
+  default:
+    return x > query->value;
+  }
+}
+
+/** Answers a query from an exact distribution. */
+double exact_query(Distribution* dist, ResultQuery* query) {
+  double p = 0;
+  for (long long i = 0; i < dist->len; i++) {
+    p += query_matches(query, dist->lo + i) ? dist->p[i] : 0;
+  }
+  return p;
+}
+
+/** Answers a query from cumulants, setting 'err' to the estimated error. */
+double approx_query(Cumulants* c, ResultQuery* query, double* err) {
+  double e1, e2, p;
+  switch (query->op) {
+  case QUERY_LT:
+    p = edgeworth_cdf(c, query->value - 1, err);
+    break;
+  case QUERY_LE:
+    p = edgeworth_cdf(c, query->value, err);
+    break;
+  case QUERY_GE:
+    p = 1 - edgeworth_cdf(c, query->value - 1, err);
+    break;
+  case QUERY_GT:
+    p = 1 - edgeworth_cdf(c, query->value, err);
+    break;
+  case QUERY_EQ:
+  default:
+    p = edgeworth_cdf(c, query->value, &e1) - edgeworth_cdf(c, query->value - 1, &e2);
+    *err = e1 + e2;
+    p = p < 0 ? 0 : p;
+    break;
+  }
+  return p;
+}
+
+/** Returns the smallest result whose cumulative probability is at least 'fraction', from cumulants.
+ *  'err' receives an error estimate in result units, from the CDF error divided by the density. */
+long long approx_quantile(Cumulants* c, double fraction, double* err) {
+  double sd = sqrt(c->k[2] > 0 ? c->k[2] : 0);
+  if (c->span == 0 || sd == 0) {
+    *err = 0;
+    return (long long) llround(c->k[1]);
+  }
+  double h = (double) c->span;
+  long long lo = (long long) floor((c->k[1] - 12 * sd - c->base) / h);
+  long long hi = (long long) ceil((c->k[1] + 12 * sd - c->base) / h);
+  double cdf_err;
+  while (lo < hi) {
+    long long mid = lo + (hi - lo) / 2;
+    if (edgeworth_cdf(c, c->base + h * mid, &cdf_err) >= fraction) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  double x = c->base + h * lo;
+  edgeworth_cdf(c, x, &cdf_err);
+  double density = normal_pdf((x - c->k[1]) / sd) / sd;
+  *err = density > 0 ? cdf_err / density : INFINITY;
+  return (long long) x;
+}
+
+/** Returns the smallest result whose cumulative probability is at least 'fraction', from an exact distribution. */
+long long exact_quantile(Distribution* dist, double fraction) {
+  double cumulative = 0;
+  for (long long i = 0; i < dist->len; i++) {
+    cumulative += dist->p[i];
+    if (cumulative >= fraction - 1e-12) {
+      return dist->lo + i;
+    }
+  }
+  return dist->lo + dist->len - 1;
+}
+
+/** Handles -analyze: describes the distribution of one expression's result and answers -query and
+ *  -percentile questions about it. The exact distribution is used when estimate_exact_cost says it is
+ *  affordable (or -method exact is given, within EXACT_FORCED_COST_LIMIT); otherwise cumulants are propagated through the tree and
+ *  the answers come from an Edgeworth expansion, with error estimates. */
+void parse_and_exec_analyze(int argc, char** argv, ConfigOptions options) {
+  if (argc != 1) {
+    print_usage();
+  }
+  ResultQuery queries[MAX_QUERIES];
+  for (int q = 0; q < options.query_count; q++) {
+    if (!parse_query(options.queries[q], &queries[q])) {
+      print_error("Queries look like '>=15', '>15', '<=15', '<15' or '=15'.");
+      exit(1);
+    }
+  }
+  ExprList* tree = parse_expr(argv[0], strlen(argv[0]), A_OP);
+  if (tree == NULL) {
+    exit(1);
+  }
+  TRACE_BEGIN(t);
+  bool quiet = (options.verbosity == VER_QUIET);
+  double lo, hi;
+  double cost = estimate_exact_cost(tree, &lo, &hi);
+  bool exact = (options.method == METHOD_EXACT) || (options.method == METHOD_AUTO && cost <= EXACT_COST_LIMIT);
+  if (options.method == METHOD_EXACT && !(cost <= EXACT_FORCED_COST_LIMIT)) {
+    print_error("This expression is far too expensive to analyze exactly; using the approximation instead.");
+    exact = false;
+  }
+
+  Distribution dist;
+  Cumulants c;
+  if (exact) {
+    if (!expr_distribution(tree, &dist)) {
+      free_expr_node(tree);
+      exit(1);
+    }
+    long double m[5] = { 1, 0, 0, 0, 0 };
+    for (long long i = 0; i < dist.len; i++) {
+      long double x = dist.lo + i;
+      m[1] += dist.p[i] * x;
+    }
+    // Central moments, to avoid cancellation when the mean is large.
+    long double central[5] = { 1, 0, 0, 0, 0 };
+    for (long long i = 0; i < dist.len; i++) {
+      long double d = dist.lo + i - m[1];
+      central[2] += dist.p[i] * d * d;
+      central[3] += dist.p[i] * d * d * d;
+      central[4] += dist.p[i] * d * d * d * d;
+    }
+    memset(&c, 0, sizeof(Cumulants));
+    c.k[1] = m[1];
+    c.k[2] = central[2];
+    c.k[3] = central[3];
+    c.k[4] = central[4] - 3 * central[2] * central[2];
+  } else if (!expr_cumulants(tree, &c)) {
+    free_expr_node(tree);
+    exit(1);
+  }
+  c.lo = lo;
+  c.hi = hi;
+  free_expr_node(tree);
+
+  double sd = sqrt(c.k[2] > 0 ? c.k[2] : 0);
+  if (quiet) {
+    printf("%.6f\n", c.k[1]);
+  } else {
+    printf("Expression: %s\n", argv[0]);
+    if (exact) {
+      printf("Method: exact\n");
+    } else if (isinf(cost)) {
+      printf("Method: approximate (Edgeworth expansion; exact distribution infeasible)\n");
+    } else {
+      printf("Method: approximate (Edgeworth expansion; exact cost estimated at %.3g operations)\n", cost);
+    }
+    printf("Mean: %.6f", c.k[1]);
+    if (!exact && c.mean_err > 0) {
+      printf(" (+/- %.3g)", c.mean_err);
+    }
+    printf("\nStd dev: %.6f", sd);
+    if (!exact && c.sd_err > 0) {
+      printf(" (+/- %.3g)", c.sd_err);
+    }
+    printf("\n");
+    if (sd > 0) {
+      printf("Skewness: %.6f\n", c.k[3] / (sd * sd * sd));
+      printf("Excess kurtosis: %.6f\n", c.k[4] / (sd * sd * sd * sd));
+    }
+  }
+
+  for (int q = 0; q < options.query_count; q++) {
+    double err = 0;
+    double p = exact ? exact_query(&dist, &queries[q]) : approx_query(&c, &queries[q], &err);
+    if (quiet) {
+      printf("%.6f\n", p);
+    } else if (exact) {
+      printf("P(result %s %d) = %.6f\n", query_op_text(queries[q].op), queries[q].value, p);
+    } else {
+      printf("P(result %s %d) = %.6f (+/- %.2g)\n", query_op_text(queries[q].op), queries[q].value, p, err);
+    }
+  }
+
+  double defaults[3] = { 5, 50, 95 };
+  int percentile_count = options.percentile_count;
+  double* percentiles = options.percentiles;
+  if (percentile_count == 0 && options.query_count == 0 && !quiet) {
+    percentile_count = 3;
+    percentiles = defaults;
+  }
+  for (int q = 0; q < percentile_count; q++) {
+    double err = 0;
+    long long x = exact ? exact_quantile(&dist, percentiles[q] / 100) : approx_quantile(&c, percentiles[q] / 100, &err);
+    if (quiet) {
+      printf("%lld\n", x);
+    } else if (exact) {
+      printf("Percentile %g: %lld\n", percentiles[q], x);
+    } else {
+      printf("Percentile %g: %lld (+/- %.0f)\n", percentiles[q], x, err);
+    }
+  }
+  if (exact) {
+    free_distribution(&dist);
+  }
+  TRACE_END(t, "analyze");
+}
+
+/** Adds 'count' occurrences of 'value' to a histogram, growing it as needed. Returns false if out of memory. */
+bool histogram_add(Histogram* hist, int value, uint64_t count) {
+  if ((hist->distinct + 1) * 2 > hist->capacity) {
+    Histogram grown;
+    grown.capacity = hist->capacity ? hist->capacity * 2 : 64;
+    grown.distinct = 0;
+    grown.values = malloc(sizeof(int) * grown.capacity);
+    grown.counts = calloc(grown.capacity, sizeof(uint64_t));
+    if (grown.values == NULL || grown.counts == NULL) {
+      free(grown.values);
+      free(grown.counts);
+      return false;
+    }
+    for (uint64_t i = 0; i < hist->capacity; i++) {
+      if (hist->counts[i]) {
+        histogram_add(&grown, hist->values[i], hist->counts[i]);
+      }
+    }
+    free_histogram(hist);
+    *hist = grown;
+  }
+  uint64_t mask = hist->capacity - 1;
+  uint64_t slot = ((uint32_t) value * 0x9e3779b1U) & mask;
+  while (hist->counts[slot] && hist->values[slot] != value) {
+    slot = (slot + 1) & mask;
+  }
+  if (hist->counts[slot] == 0) {
+    hist->values[slot] = value;
+    hist->distinct++;
+  }
+  hist->counts[slot] += count;
+  return true;
+}
+
+/** Frees the storage of a histogram, leaving it empty. */
+void free_histogram(Histogram* hist) {
+  free(hist->values);
+  free(hist->counts);
+  hist->values = NULL;
+  hist->counts = NULL;
+  hist->capacity = 0;
+  hist->distinct = 0;
+}
+
+/** Comparison function for sorting histogram entries by value. */
+int compare_histogram_entry(const void* e1, const void* e2) {
+  int v1 = *(const int*) e1;
+  int v2 = *(const int*) e2;
+  return (v1 > v2) - (v1 < v2);
+}
+
+// One (value, count) pair from a histogram, in value order.
+typedef struct {
+  int value;
+  uint64_t count;
+} HistogramEntry;
+
+/** Returns the histogram's entries sorted by value (caller frees), or NULL if out of memory. */
+HistogramEntry* histogram_sorted(Histogram* hist) {
+  HistogramEntry* entries = malloc(sizeof(HistogramEntry) * (hist->distinct ? hist->distinct : 1));
+  if (entries == NULL) {
+    return NULL;
+  }
+  uint64_t n = 0;
+  for (uint64_t i = 0; i < hist->capacity; i++) {
+    if (hist->counts[i]) {
+      entries[n].value = hist->values[i];
+      entries[n].count = hist->counts[i];
+      n++;
+    }
+  }
+  qsort(entries, n, sizeof(HistogramEntry), compare_histogram_entry);
+  return entries;
+}
+
+/** Frees the storage held by a simulation result. */
+void free_sim_result(SimResult* result) {
+  free(result->expr);
+  free(result->shards_present);
+  free_histogram(&result->hist);
+}
+
+/** Runs this shard's slice of the simulation into 'result'. Trials are split into blocks of
+ *  SIM_BLOCK_TRIALS, and block b draws from the seeded stream jumped b times, so every trial
+ *  sees the same random numbers however the blocks are divided among shards. */
+bool run_sim_shard(ExprList* tree, ConfigOptions* options, SimResult* result) {
+  uint64_t blocks = (options->sim_trials + SIM_BLOCK_TRIALS - 1) / SIM_BLOCK_TRIALS;
+  uint64_t first_block = blocks * (options->shard_index - 1) / options->shard_count;
+  uint64_t end_block = blocks * options->shard_index / options->shard_count;
+
+  RandomState cursor;
+  random_state_seed(&cursor, options->seed);
+  for (uint64_t b = 0; b < first_block; b++) {
+    random_state_jump(&cursor);
+  }
+  for (uint64_t b = first_block; b < end_block; b++) {
+    TRACE_BEGIN(t);
+    RandomState block_state = cursor;
+    random_state_jump(&cursor);
+    set_active_random(&block_state);
+    uint64_t end_trial = (b + 1) * SIM_BLOCK_TRIALS;
+    if (end_trial > options->sim_trials) {
+      end_trial = options->sim_trials;
+    }
+    for (uint64_t trial = b * SIM_BLOCK_TRIALS; trial < end_trial; trial += BATCH_LANES) {
+      // A short final batch is still evaluated in full, since a batch draws its random numbers node
+      // by node across all lanes; trial i is then always lane i of its batch, whatever the count.
+      int lanes = (end_trial - trial < BATCH_LANES) ? (int) (end_trial - trial) : BATCH_LANES;
+      int results[BATCH_LANES];
+      execute_expr_batch(tree, results, BATCH_LANES);
+      for (int l = 0; l < lanes; l++) {
+        if (!histogram_add(&result->hist, results[l], 1)) {
+          set_active_random(NULL);
+          print_error("Out of memory.");
+          return false;
+        }
+      }
+      result->trials += lanes;
+    }
+    set_active_random(NULL);
+    TRACE_END(t, "sim_block");
+  }
+  return true;
+}
+
+/** Prints summary statistics for a (possibly merged) simulation result. The statistics are
+ *  computed from the value-sorted histogram alone, so they do not depend on how it was built. */
+void print_sim_report(SimResult* result, bool quiet) {
+  HistogramEntry* entries = histogram_sorted(&result->hist);
+  if (entries == NULL) {
+    print_error("Out of memory.");
+    return;
+  }
+  uint64_t n = result->hist.distinct;
+  long double sum = 0, sum_sq = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    sum += (long double) entries[i].value * entries[i].count;
+  }
+  long double mean = result->trials ? sum / result->trials : 0;
+  for (uint64_t i = 0; i < n; i++) {
+    long double d = entries[i].value - mean;
+    sum_sq += d * d * entries[i].count;
+  }
+  double stddev = result->trials > 1 ? sqrt((double) (sum_sq / (result->trials - 1))) : 0.0;
+  int median = 0;
+  uint64_t seen = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    seen += entries[i].count;
+    if (seen * 2 >= result->trials) {
+      median = entries[i].value;
+      break;
+    }
+  }
+  if (quiet) {
+    printf("%.6f\n", (double) mean);
+  } else {
+    printf("Expression: %s\n", result->expr);
+    printf("Seed: %llu\n", (unsigned long long) result->seed);
+    printf("Trials: %llu\n", (unsigned long long) result->trials);
+    if (n > 0) {
+      printf("Mean: %.6f\n", (double) mean);
+      printf("Std dev: %.6f\n", stddev);
+      printf("Min: %d\n", entries[0].value);
+      printf("Median: %d\n", median);
+      printf("Max: %d\n", entries[n-1].value);
+    }
+  }
+  free(entries);
+}
+
+/** Writes an unsigned integer of 'bytes' bytes in little-endian order. */
+void write_le(FILE* out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    fputc((int) ((value >> (8 * i)) & 0xff), out);
+  }
+}
+
+/** Reads an unsigned little-endian integer of 'bytes' bytes; sets *ok to false on a short read. */
+uint64_t read_le(FILE* in, int bytes, bool* ok) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    int c = fgetc(in);
+    if (c == EOF) {
+      *ok = false;
+      return 0;
+    }
+    value |= ((uint64_t) c) << (8 * i);
+  }
+  return value;
+}
+
+/** Writes a simulation result as a shard file: a header identifying the simulation and the
+ *  shards it covers, followed by the histogram as value-sorted (value, count) pairs. */
+bool write_shard_file(char* path, SimResult* result) {
+  HistogramEntry* entries = histogram_sorted(&result->hist);
+  if (entries == NULL) {
+    print_error("Out of memory.");
+    return false;
+  }
+  FILE* out = fopen(path, "wb");
+  if (out == NULL) {
+    free(entries);
+    print_error("Could not open shard output file.");
+    return false;
+  }
+  fwrite(SHARD_FILE_MAGIC, 1, 8, out);
+  write_le(out, SHARD_FILE_VERSION, 4);
+  write_le(out, result->seed, 8);
+  write_le(out, result->total_trials, 8);
+  write_le(out, result->trials, 8);
+  write_le(out, result->shard_count, 4);
+  for (int i = 0; i < result->shard_count; i++) {
+    fputc(result->shards_present[i] ? 1 : 0, out);
+  }
+  uint32_t expr_len = strlen(result->expr);
+  write_le(out, expr_len, 4);
+  fwrite(result->expr, 1, expr_len, out);
+  write_le(out, result->hist.distinct, 8);
+  for (uint64_t i = 0; i < result->hist.distinct; i++) {
+    write_le(out, (uint32_t) entries[i].value, 4);
+    write_le(out, entries[i].count, 8);
+  }
+  free(entries);
+  bool ok = !ferror(out);
+  if (fclose(out) != 0 || !ok) {
+    print_error("Failed writing shard output file.");
+    return false;
+  }
+  return true;
+}
+
+/** Reads a shard file into 'result'. Returns false (after reporting why) if it is not a valid shard file. */
+bool read_shard_file(char* path, SimResult* result) {
+  memset(result, 0, sizeof(SimResult));
+  FILE* in = fopen(path, "rb");
+  if (in == NULL) {
+    print_error("Could not open shard file.");
+    return false;
+  }
+  char magic[8];
+  bool ok = (fread(magic, 1, 8, in) == 8) && (memcmp(magic, SHARD_FILE_MAGIC, 8) == 0);
+  if (!ok) {
+    fclose(in);
+    print_error("Not a dice shard file.");
+    return false;
+  }
+  if (read_le(in, 4, &ok) != SHARD_FILE_VERSION || !ok) {
+    fclose(in);
+    print_error("Unsupported shard file version.");
+    return false;
+  }
+  result->seed = read_le(in, 8, &ok);
+  result->total_trials = read_le(in, 8, &ok);
+  result->trials = read_le(in, 8, &ok);
+  result->shard_count = (int) read_le(in, 4, &ok);
+  if (ok && result->shard_count > 0 && result->shard_count <= 1 << 20) {
+    result->shards_present = calloc(result->shard_count, sizeof(bool));
+    for (int i = 0; ok && result->shards_present && i < result->shard_count; i++) {
+      result->shards_present[i] = read_le(in, 1, &ok) != 0;
+    }
+  }
+  uint32_t expr_len = ok ? (uint32_t) read_le(in, 4, &ok) : 0;
+  if (ok && result->shards_present && expr_len <= MAX_CMDLEN * 64) {
+    result->expr = malloc(expr_len + 1);
+    if (result->expr && fread(result->expr, 1, expr_len, in) == expr_len) {
+      result->expr[expr_len] = '\0';
+    } else {
+      ok = false;
+    }
+  } else {
+    ok = false;
+  }
+  uint64_t distinct = ok ? read_le(in, 8, &ok) : 0;
+  uint64_t counted = 0;
+  for (uint64_t i = 0; ok && i < distinct; i++) {
+    int value = (int) (uint32_t) read_le(in, 4, &ok);
+    uint64_t count = read_le(in, 8, &ok);
+    //Every entry records at least one trial, and together they account for exactly the header's trials.
+    if (count == 0 || count > result->trials - counted) {
+      ok = false;
+    }
+    counted += count;
+    if (ok && !histogram_add(&result->hist, value, count)) {
+      ok = false;
+    }
+  }
+  if (counted != result->trials) {
+    ok = false;
+  }
+  fclose(in);
+  if (!ok) {
+    free_sim_result(result);
+    print_error("Truncated or corrupt shard file.");
+    return false;
+  }
+  return true;
+}
+
+/** Handles simulation mode: runs one expression for -sim N trials (or this process's -shard of them),
+ *  then prints statistics or writes a shard file with -o. */
+void parse_and_exec_sim(int argc, char** argv, ConfigOptions options) {
+  if (argc != 1) {
+    print_usage();
+  }
+  bool quiet = (options.verbosity == VER_QUIET);
+  if (options.shard_count > 1 && !options.seed_set) {
+    print_error("-shard requires an explicit -seed so that every shard draws from the same stream.");
+    exit(1);
+  }
+  if (!options.seed_set) {
+    init_random();
+    options.seed = ((uint64_t) get_next_random() << 33) ^ ((uint64_t) get_next_random() << 2) ^ (uint64_t) time(NULL);
+  }
+  ExprList* tree = parse_expr(argv[0], strlen(argv[0]), A_OP);
+  if (tree == NULL) {
+    exit(1);
+  }
+  SimResult result;
+  memset(&result, 0, sizeof(SimResult));
+  result.expr = malloc(strlen(argv[0]) + 1);
+  result.shards_present = calloc(options.shard_count, sizeof(bool));
+  if (result.expr == NULL || result.shards_present == NULL) {
+    print_error("Out of memory.");
+    exit(1);
+  }
+  strcpy(result.expr, argv[0]);
+  result.seed = options.seed;
+  result.total_trials = options.sim_trials;
+  result.shard_count = options.shard_count;
+  result.shards_present[options.shard_index - 1] = true;
+
+  bool ok = run_sim_shard(tree, &options, &result);
+  free_expr_node(tree);
+  if (ok) {
+    if (options.output_path != NULL) {
+      ok = write_shard_file(options.output_path, &result);
+      if (ok && !quiet) {
+        printf("Shard %d/%d: %llu trials written to %s\n", options.shard_index, options.shard_count,
+               (unsigned long long) result.trials, options.output_path);
+      }
+    } else {
+      print_sim_report(&result, quiet);
+    }
+  }
+  free_sim_result(&result);
+  if (!ok) {
+    exit(1);
+  }
+}
+
+/** Returns the two-sided standard normal critical value for a confidence level, e.g. 1.96 for 0.95. */
+double normal_critical_value(double confidence) {
+  double tail = (1 - confidence) / 2;
+  double lo = 0, hi = 40;
+  for (int i = 0; i < 100; i++) {
+    double mid = (lo + hi) / 2;
+    if (0.5 * erfc(mid / sqrt(2.0)) > tail) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo + hi) / 2;
+}
+
+/** Computes the Wilson score interval for a proportion of 'hits' in 'trials', which (unlike the normal
+ *  approximation) stays sensible when the proportion is at or near 0 or 1. Returns its half-width. */
+double wilson_interval(uint64_t hits, uint64_t trials, double z, double* lo, double* hi) {
+  if (trials == 0) {
+    *lo = 0;
+    *hi = 1;
+    return INFINITY;
+  }
+  double n = (double) trials;
+  double p = hits / n;
+  double denom = 1 + z * z / n;
+  double centre = (p + z * z / (2 * n)) / denom;
+  double half = z / denom * sqrt(p * (1 - p) / n + z * z / (4 * n * n));
+  *lo = centre - half < 0 ? 0 : centre - half;
+  *hi = centre + half > 1 ? 1 : centre + half;
+  return half;
+}
+
+/** Returns the half-width of the normal confidence interval for the mean so far. While every trial
+ *  has given the same result the sample variance is 0 and says nothing, so the half-width is instead
+ *  bounded by how far the mean could move if results elsewhere in the expression's range [lo, hi]
+ *  occurred as often as the upper end of the Wilson interval for "0 of n trials" allows. */
+double sim_mean_half_width(SimTracker* tracker, double z) {
+  if (tracker->trials < 2) {
+    return INFINITY;
+  }
+  if (tracker->m2 == 0) {
+    double lo, hi;
+    wilson_interval(0, tracker->trials, z, &lo, &hi);
+    double spread = fmax(tracker->hi - (double) tracker->mean, (double) tracker->mean - tracker->lo);
+    return hi * spread;
+  }
+  double variance = (double) (tracker->m2 / (tracker->trials - 1));
+  return z * sqrt(variance / tracker->trials);
+}
+
+/** Returns whether every tracked interval is at least as narrow as requested. The mean is tracked when
+ *  -mean-precision is given or there are no queries. */
+bool sim_precision_reached(SimTracker* tracker, ConfigOptions* options, double z) {
+  bool track_mean = options->mean_precision_set || options->query_count == 0;
+  if (track_mean && sim_mean_half_width(tracker, z) > options->mean_precision) {
+    return false;
+  }
+  for (int q = 0; q < options->query_count; q++) {
+    double lo, hi;
+    if (wilson_interval(tracker->hits[q], tracker->trials, z, &lo, &hi) > options->precision) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Returns the seconds elapsed since 'start'. */
+double seconds_since(struct timespec* start) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** Handles -sim-until: rolls one expression in batches of BATCH_LANES trials until the confidence
+ *  intervals for the mean (and for each -query probability) are within the requested precision, or
+ *  the trial or time budget is spent. Trials draw from the same block-jumped stream as -sim, so with
+ *  the same seed the first N trials match those of '-sim N'. */
+void parse_and_exec_sim_until(int argc, char** argv, ConfigOptions options) {
+  if (argc != 1) {
+    print_usage();
+  }
+  bool quiet = (options.verbosity == VER_QUIET);
+  ResultQuery queries[MAX_QUERIES];
+  for (int q = 0; q < options.query_count; q++) {
+    if (!parse_query(options.queries[q], &queries[q])) {
+      print_error("Queries look like '>=15', '>15', '<=15', '<15' or '=15'.");
+      exit(1);
+    }
+  }
+  if (!options.seed_set) {
+    init_random();
+    options.seed = ((uint64_t) get_next_random() << 33) ^ ((uint64_t) get_next_random() << 2) ^ (uint64_t) time(NULL);
+  }
+  ExprList* tree = parse_expr(argv[0], strlen(argv[0]), A_OP);
+  if (tree == NULL) {
+    exit(1);
+  }
+  SimResult result;
+  memset(&result, 0, sizeof(SimResult));
+  result.expr = argv[0];
+  result.seed = options.seed;
+  SimTracker tracker;
+  memset(&tracker, 0, sizeof(SimTracker));
+  estimate_exact_cost(tree, &tracker.lo, &tracker.hi);
+  double z = normal_critical_value(options.confidence);
+  struct timespec start;
+  timespec_get(&start, TIME_UTC);
+
+  RandomState cursor;
+  random_state_seed(&cursor, options.seed);
+  const char* reason = NULL;
+  bool ok = true;
+  while (ok && reason == NULL) {
+    TRACE_BEGIN(t);
+    RandomState block_state = cursor;
+    random_state_jump(&cursor);
+    set_active_random(&block_state);
+    for (int batch = 0; batch < SIM_BLOCK_TRIALS / BATCH_LANES; batch++) {
+      if (tracker.trials >= options.max_trials) {
+        reason = "trial budget spent";
+        break;
+      }
+      // As in run_sim_shard, a batch cut short by the trial budget is evaluated in full and truncated.
+      int lanes = (options.max_trials - tracker.trials < BATCH_LANES) ? (int) (options.max_trials - tracker.trials) : BATCH_LANES;
+      int results[BATCH_LANES];
+      execute_expr_batch(tree, results, BATCH_LANES);
+      for (int l = 0; l < lanes; l++) {
+        tracker.trials++;
+        long double delta = results[l] - tracker.mean;
+        tracker.mean += delta / tracker.trials;
+        tracker.m2 += delta * (results[l] - tracker.mean);
+        for (int q = 0; q < options.query_count; q++) {
+          tracker.hits[q] += query_matches(&queries[q], results[l]);
+        }
+        if (!histogram_add(&result.hist, results[l], 1)) {
+          print_error("Out of memory.");
+          ok = false;
+          break;
+        }
+      }
+      result.trials = tracker.trials;
+      if (!ok) {
+        break;
+      }
+      if (sim_precision_reached(&tracker, &options, z)) {
+        reason = "precision reached";
+        break;
+      }
+      if (options.max_seconds > 0 && seconds_since(&start) >= options.max_seconds) {
+        reason = "time budget spent";
+        break;
+      }
+    }
+    set_active_random(NULL);
+    TRACE_END(t, "sim_block");
+  }
+  free_expr_node(tree);
+  if (!ok) {
+    free_histogram(&result.hist);
+    exit(1);
+  }
+
+  print_sim_report(&result, quiet);
+  double half = sim_mean_half_width(&tracker, z);
+  if (quiet) {
+    for (int q = 0; q < options.query_count; q++) {
+      printf("%.6f\n", tracker.hits[q] / (double) tracker.trials);
+    }
+  } else {
+    printf("Stopped: %s after %.3f seconds\n", reason, seconds_since(&start));
+    // The mean cannot lie outside the range of possible results.
+    printf("Mean %g%% interval: [%.6f, %.6f] (+/- %.6f)\n", options.confidence * 100,
+           fmax((double) tracker.mean - half, tracker.lo), fmin((double) tracker.mean + half, tracker.hi), half);
+    for (int q = 0; q < options.query_count; q++) {
+      double lo, hi;
+      double qhalf = wilson_interval(tracker.hits[q], tracker.trials, z, &lo, &hi);
+      printf("P(result %s %d) = %.6f, %g%% interval: [%.6f, %.6f] (+/- %.6f)\n", query_op_text(queries[q].op),
+             queries[q].value, tracker.hits[q] / (double) tracker.trials, options.confidence * 100, lo, hi, qhalf);
+    }
+  }
+  free_histogram(&result.hist);
+}
+
+/** Returns the number of tokens (runs of bytes other than space, newline and NUL) in indexed input. */
+uint64_t count_indexed_tokens(ScanIndex* index) {
+  uint64_t tokens = 0;
+  uint64_t carry = 1;
+  for (size_t b = 0; b < index->block_count; b++) {
+    ScanBlock* block = &index->blocks[b];
+    uint64_t separators = block->space | block->newline | block->nul;
+    uint64_t starts = ~separators & ((separators << 1) | carry) & scan_range_mask(b, 0, index->len);
+    tokens += count_bits(starts);
+    carry = separators >> (SCAN_BLOCK_BYTES - 1);
+  }
+  return tokens;
+}
+
+/** Times one way of tokenizing 'text' for at least half a second and returns its speed in GB/s.
+ *  'method' 0 splits tokens with strcspn a byte at a time, as the parser does without an index;
+ *  1 and 2 build the scan index with the scalar or AVX2 classifier and count tokens from its masks. */
+double bench_tokenize(char* text, size_t len, int method, ScanIndex* index, uint64_t* tokens) {
+  struct timespec start;
+  timespec_get(&start, TIME_UTC);
+  uint64_t reps = 0;
+  double elapsed;
+  do {
+    *tokens = 0;
+    if (method == 0) {
+      for (char* p = text; *p; ) {
+        size_t n = strcspn(p, " \n");
+        *tokens += (n > 0);
+        p += n;
+        if (*p) {
+          p++;
+        }
+      }
+    } else {
+      scan_index_build_with(index, text, len, method == 1);
+      *tokens = count_indexed_tokens(index);
+    }
+    reps++;
+    elapsed = seconds_since(&start);
+  } while (elapsed < 0.5 || reps < 3);
+  return (double) len * reps / elapsed / 1e9;
+}
+
+/** Handles -bench-scan: reports how fast a file of rolls is tokenized byte by byte and with the scan
+ *  index (scalar and, where available, AVX2 classification), after checking the two classifiers agree. */
+void parse_and_exec_bench_scan(ConfigOptions options) {
+  size_t len;
+  char* text = read_file_contents(options.input_path, &len);
+  if (text == NULL) {
+    print_error("Could not read input file.");
+    exit(1);
+  }
+  ScanIndex scalar, vector;
+  memset(&scalar, 0, sizeof(ScanIndex));
+  memset(&vector, 0, sizeof(ScanIndex));
+  uint64_t byte_tokens, scalar_tokens, vector_tokens;
+  double byte_rate = bench_tokenize(text, len, 0, NULL, &byte_tokens);
+  double scalar_rate = bench_tokenize(text, len, 1, &scalar, &scalar_tokens);
+  double vector_rate = bench_tokenize(text, len, 2, &vector, &vector_tokens);
+  bool agree = (scalar_tokens == byte_tokens && vector_tokens == byte_tokens && scalar.block_count == vector.block_count &&
+                (len == 0 || memcmp(scalar.blocks, vector.blocks, sizeof(ScanBlock) * scalar.block_count) == 0));
+  uint64_t lines = 0;
+  for (size_t b = 0; b < scalar.block_count; b++) {
+    lines += count_bits(scalar.blocks[b].newline);
+  }
+  printf("Input: %llu bytes, %llu lines, %llu tokens\n", (unsigned long long) len, (unsigned long long) lines,
+         (unsigned long long) byte_tokens);
+  printf("Byte by byte (strcspn): %.2f GB/s\n", byte_rate);
+  printf("Scan index, scalar: %.2f GB/s\n", scalar_rate);
+  if (cpu_has_avx2()) {
+    printf("Scan index, AVX2: %.2f GB/s\n", vector_rate);
+  } else {
+    printf("Scan index, AVX2: not available (the scalar classifier was used)\n");
+  }
+  scan_index_free(&scalar);
+  scan_index_free(&vector);
+  free(text);
+  if (!agree) {
+    print_error("Tokenizers disagree.");
+    exit(1);
+  }
+}
+
+/** Handles -merge: combines shard files of one simulation into its final statistics (and,
+ *  with -o, a merged shard file), checking that they come from the same run and do not overlap. */
+void parse_and_exec_merge(int argc, char** argv, ConfigOptions options) {
+  if (argc == 0) {
+    print_usage();
+  }
+  SimResult merged;
+  if (!read_shard_file(argv[0], &merged)) {
+    exit(1);
+  }
+  for (int i = 1; i < argc; i++) {
+    SimResult shard;
+    if (!read_shard_file(argv[i], &shard)) {
+      free_sim_result(&merged);
+      exit(1);
+    }
+    if (shard.seed != merged.seed || shard.total_trials != merged.total_trials ||
+        shard.shard_count != merged.shard_count || strcmp(shard.expr, merged.expr) != 0) {
+      print_error("Shard files come from different simulations (expression, seed, trials or shard count differ).");
+      free_sim_result(&shard);
+      free_sim_result(&merged);
+      exit(1);
+    }
+    for (int s = 0; s < shard.shard_count; s++) {
+      if (shard.shards_present[s] && merged.shards_present[s]) {
+        print_error("The same shard appears more than once.");
+        free_sim_result(&shard);
+        free_sim_result(&merged);
+        exit(1);
+      }
+      merged.shards_present[s] = merged.shards_present[s] || shard.shards_present[s];
+    }
+    for (uint64_t slot = 0; slot < shard.hist.capacity; slot++) {
+      if (shard.hist.counts[slot] && !histogram_add(&merged.hist, shard.hist.values[slot], shard.hist.counts[slot])) {
+        print_error("Out of memory.");
+        exit(1);
+      }
+    }
+    merged.trials += shard.trials;
+    free_sim_result(&shard);
+  }
+  bool quiet = (options.verbosity == VER_QUIET);
+  int missing = 0;
+  for (int s = 0; s < merged.shard_count; s++) {
+    missing += merged.shards_present[s] ? 0 : 1;
+  }
+  if (missing && !quiet) {
+    printf("Warning: %d of %d shards missing; statistics cover %llu of %llu trials.\n", missing, merged.shard_count,
+           (unsigned long long) merged.trials, (unsigned long long) merged.total_trials);
+  }
+  bool ok = true;
+  if (options.output_path != NULL) {
+    ok = write_shard_file(options.output_path, &merged);
+  }
+  print_sim_report(&merged, quiet);
+  free_sim_result(&merged);
+  if (!ok) {
+    exit(1);
+  }
+}
+
+/** Handles the overall operation of the program in command-line invocational mode. */
+void parse_and_exec_cmdline(int argc, char** argv, ConfigOptions options) {
+  if (argc == 0) {
+    print_usage();
+  }
+  bool verbose = (options.verbosity == VER_VERBOSE);
+  bool quiet = (options.verbosity == VER_QUIET);
+
+  init_random();
+  if (verbose) {
+    printf("----------------------------\n");
+  }
+  for (int i = 0; i < argc; i++) {
+    if (!quiet) {
+      printf("Roll %d:", i + 1);
+    }
+    if (verbose) {
+      printf("\n----------------------------\n");
+    } else if (!quiet) {
+      printf(" ");
+    }
+    ExprList* tree = parse_expr(argv[i], strlen(argv[i]), A_OP);
     if (tree != NULL) {
+      TRACE_BEGIN(t_exec);
       int result = execute_expr(tree, verbose);
+      TRACE_END(t_exec, "execute_expr");
+      TRACE_BEGIN(t_out);
       if (verbose) {
         printf("Total: ");
       }
       printf("%d\n", result);
+      TRACE_END(t_out, "output");
       free_expr_node(tree);
     }
     if (verbose) {
@@ -677,53 +4258,474 @@ void parse_and_exec_set_command(char* cmd, ConfigOptions* options) {
     } else {
       print_error("Unrecognized verbosity setting.");
     }
+  } else if ((strlen(cmd) >= 6) && (strncmp(cmd, "macro ", 6) == 0)) {
+    char* name = cmd + 6;
+    int name_len = strcspn(name, " \t\n");
+    char* expr = name + name_len;
+    int expr_len = strlen(expr);
+    trim_span(&expr, &expr_len);
+    if (name_len == 0 || expr_len == 0) {
+      print_error("Usage: set macro NAME EXPR");
+    } else if (define_macro(name, name_len, expr, expr_len)) {
+      printf("Macro %.*s set to %.*s\n", name_len, name, expr_len, expr);
+    }
   } else {
     print_error("Unrecognized setting.");
   }
 }
 
-void parse_and_exec_interactive_input(char* input, ConfigOptions* options) {
-  if ((strlen(input) >= 4) && (strncmp(input, "set ", 4) == 0)) {
-    //If some program state is to be updated
-    parse_and_exec_set_command(input+4, options);
+// The compiled-expression cache used for interactive/stream input on this thread, if any.
+static THREAD_LOCAL ExprCache* expr_cache = NULL;
+
+/** Hashes expression text (64-bit FNV-1a). */
+uint64_t hash_expr_text(const char* text, int len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) text[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/** Sets up an empty cache holding at most 'capacity' expressions. Returns false if out of memory. */
+bool expr_cache_init(ExprCache* cache, int capacity) {
+  memset(cache, 0, sizeof(ExprCache));
+  if (capacity <= 0 || capacity > EXPR_CACHE_MAX_CAPACITY) {
+    return false;
+  }
+  int buckets = 1;
+  while (buckets < capacity * 2) {
+    buckets *= 2;
+  }
+  cache->entries = calloc(capacity, sizeof(ExprCacheEntry));
+  cache->buckets = malloc(sizeof(int) * buckets);
+  if (cache->entries == NULL || cache->buckets == NULL) {
+    expr_cache_free(cache);
+    return false;
+  }
+  for (int i = 0; i < buckets; i++) {
+    cache->buckets[i] = -1;
+  }
+  cache->bucket_mask = buckets - 1;
+  cache->capacity = capacity;
+  cache->lru_head = -1;
+  cache->lru_tail = -1;
+  return true;
+}
+
+/** Frees everything held by a cache (its counters are kept). */
+void expr_cache_free(ExprCache* cache) {
+  for (int i = 0; i < cache->count; i++) {
+    free(cache->entries[i].text);
+    free_plan(&cache->entries[i].plan);
+  }
+  free(cache->entries);
+  free(cache->buckets);
+  cache->entries = NULL;
+  cache->buckets = NULL;
+  cache->capacity = 0;
+  cache->count = 0;
+}
+
+/** Forgets every cached expression (its counters are kept), e.g. after a macro they may inline changes. */
+void expr_cache_clear(ExprCache* cache) {
+  for (int i = 0; i < cache->count; i++) {
+    free(cache->entries[i].text);
+    free_plan(&cache->entries[i].plan);
+  }
+  for (int i = 0; i <= cache->bucket_mask; i++) {
+    cache->buckets[i] = -1;
+  }
+  cache->count = 0;
+  cache->lru_head = -1;
+  cache->lru_tail = -1;
+}
+
+/** Unlinks an entry from the recency list. */
+void expr_cache_lru_unlink(ExprCache* cache, int index) {
+  ExprCacheEntry* entry = &cache->entries[index];
+  if (entry->lru_prev >= 0) {
+    cache->entries[entry->lru_prev].lru_next = entry->lru_next;
   } else {
-    //If it is a set of rolls
-    bool verbose = (options->verbosity == VER_VERBOSE);
-    bool quiet = (options->verbosity == VER_QUIET);
+    cache->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next >= 0) {
+    cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+  } else {
+    cache->lru_tail = entry->lru_prev;
+  }
+}
 
-    if (verbose) {
-      printf("----------------------------\n");
+/** Links an entry in at the most-recently-used end of the recency list. */
+void expr_cache_lru_push(ExprCache* cache, int index) {
+  ExprCacheEntry* entry = &cache->entries[index];
+  entry->lru_prev = -1;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head >= 0) {
+    cache->entries[cache->lru_head].lru_prev = index;
+  } else {
+    cache->lru_tail = index;
+  }
+  cache->lru_head = index;
+}
+
+/** Finds the compiled form of an expression, counting a hit or a miss. Returns NULL on a miss. */
+Plan* expr_cache_lookup(ExprCache* cache, char* text, int len) {
+  uint64_t hash = hash_expr_text(text, len);
+  for (int i = cache->buckets[hash & cache->bucket_mask]; i >= 0; i = cache->entries[i].chain_next) {
+    ExprCacheEntry* entry = &cache->entries[i];
+    if (entry->hash == hash && entry->len == len && memcmp(entry->text, text, len) == 0) {
+      cache->hits++;
+      expr_cache_lru_unlink(cache, i);
+      expr_cache_lru_push(cache, i);
+      return &entry->plan;
     }
+  }
+  cache->misses++;
+  return NULL;
+}
 
-    char* current_location = input;
-    
-    for (int i = 1; *current_location; i++) {
-      if (!quiet) {
-        printf("Roll %d:", i);
+/** Stores a compiled expression (taking ownership of the plan), evicting the least recently used
+ *  entry if the cache is full. Returns the cached plan, or NULL if out of memory. */
+Plan* expr_cache_insert(ExprCache* cache, char* text, int len, Plan plan) {
+  char* copy = malloc(len + 1);
+  if (copy == NULL) {
+    free_plan(&plan);
+    return NULL;
+  }
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+
+  int index;
+  if (cache->count < cache->capacity) {
+    index = cache->count++;
+  } else {
+    index = cache->lru_tail;
+    ExprCacheEntry* victim = &cache->entries[index];
+    expr_cache_lru_unlink(cache, index);
+    int* link = &cache->buckets[victim->hash & cache->bucket_mask];
+    while (*link != index) {
+      link = &cache->entries[*link].chain_next;
+    }
+    *link = victim->chain_next;
+    free(victim->text);
+    free_plan(&victim->plan);
+  }
+  ExprCacheEntry* entry = &cache->entries[index];
+  entry->hash = hash_expr_text(text, len);
+  entry->text = copy;
+  entry->len = len;
+  entry->plan = plan;
+  entry->chain_next = cache->buckets[entry->hash & cache->bucket_mask];
+  cache->buckets[entry->hash & cache->bucket_mask] = index;
+  expr_cache_lru_push(cache, index);
+  return &entry->plan;
+}
+
+/** Makes interactive/stream input on this thread use 'cache' (or no cache, if NULL). */
+void set_expr_cache(ExprCache* cache) {
+  expr_cache = cache;
+}
+
+/** Returns the compiled form of an expression from this thread's cache, parsing and compiling it
+ *  on a miss. A macro invoked on its own is executed straight from its own plan. Returns NULL (after reporting the error) if the expression does not parse. */
+Plan* get_compiled_expr(char* text, int len) {
+  int macro = find_macro(text, len);
+  if (macro >= 0) {
+    return get_macro_plan(macro);
+  }
+  Plan* cached = expr_cache_lookup(expr_cache, text, len);
+  if (cached != NULL) {
+    return cached;
+  }
+  ExprList* tree = parse_expr(text, len, A_OP);
+  if (tree == NULL) {
+    return NULL;
+  }
+  Plan plan;
+  memset(&plan, 0, sizeof(Plan));
+  bool ok = compile_expr(tree, &plan);
+  free_expr_node(tree);
+  if (!ok) {
+    free_plan(&plan);
+    return NULL;
+  }
+  cached = expr_cache_insert(expr_cache, text, len, plan);
+  if (cached == NULL) {
+    print_error("Out of memory.");
+  }
+  return cached;
+}
+
+/** Reports a cache's hit and miss counters on stderr. */
+void print_cache_stats(uint64_t hits, uint64_t misses, int entries, int capacity) {
+  fprintf(stderr, "Expression cache: %llu hits, %llu misses, %d of %d entries used\n",
+          (unsigned long long) hits, (unsigned long long) misses, entries, capacity);
+}
+
+// Macros defined with 'set macro' or loaded with -macros. Shared by every thread, and only changed
+// while no other threads are running (at startup, or between lines of interactive input).
+static MacroTable macro_table = { NULL, 0, 0 };
+
+/** Returns the index of the macro called 'name' (of length len), or -1 if there is none. */
+int find_macro(const char* name, int len) {
+  for (int i = 0; i < macro_table.count; i++) {
+    if (macro_table.entries[i].name_len == len && memcmp(macro_table.entries[i].name, name, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** Returns the parse tree of a macro. */
+ExprList* get_macro_tree(int index) {
+  return macro_table.entries[index].tree;
+}
+
+/** Returns the compiled plan of a macro. */
+Plan* get_macro_plan(int index) {
+  return &macro_table.entries[index].plan;
+}
+
+/** Returns true iff evaluating 'expr' would use macro 'target', directly or through other macros.
+ *  'visited' has one flag per macro, so that each is searched at most once. */
+bool expr_uses_macro(ExprList* expr, int target, bool* visited) {
+  if (expr == NULL) {
+    return false;
+  }
+  ObjNode* obj = expr->obj;
+  if (obj != NULL) {
+    if (obj->macro == target) {
+      return true;
+    }
+    if (obj->macro >= 0 && !visited[obj->macro]) {
+      visited[obj->macro] = true;
+      if (expr_uses_macro(get_macro_tree(obj->macro), target, visited)) {
+        return true;
       }
-      if (verbose) {
-        printf("\n----------------------------\n");
-      } else if (!quiet) {
-        printf(" ");
+    }
+    if (expr_uses_macro(obj->subList, target, visited)) {
+      return true;
+    }
+  }
+  return expr_uses_macro(expr->lhList, target, visited) || expr_uses_macro(expr->rhList, target, visited);
+}
+
+bool compile_macro(int index, bool* done);
+
+/** Compiles every macro used in 'expr' that has not been compiled yet. */
+bool compile_used_macros(ExprList* expr, bool* done) {
+  if (expr == NULL) {
+    return true;
+  }
+  if (expr->obj != NULL) {
+    if (expr->obj->macro >= 0 && !compile_macro(expr->obj->macro, done)) {
+      return false;
+    }
+    if (!compile_used_macros(expr->obj->subList, done)) {
+      return false;
+    }
+  }
+  return compile_used_macros(expr->lhList, done) && compile_used_macros(expr->rhList, done);
+}
+
+/** (Re)compiles a macro's plan, after the macros it uses so that their current plans are inlined. */
+bool compile_macro(int index, bool* done) {
+  if (done[index]) {
+    return true;
+  }
+  done[index] = true;
+  if (!compile_used_macros(macro_table.entries[index].tree, done)) {
+    return false;
+  }
+  Plan plan;
+  memset(&plan, 0, sizeof(Plan));
+  if (!compile_expr(macro_table.entries[index].tree, &plan)) {
+    free_plan(&plan);
+    return false;
+  }
+  free_plan(&macro_table.entries[index].plan);
+  macro_table.entries[index].plan = plan;
+  return true;
+}
+
+/** Defines (or redefines) a macro. The expression is parsed, validated and compiled once here; macros
+ *  it uses are looked up now and inlined into its plan. Redefinitions that would make a macro use itself
+ *  are rejected, and every other macro is recompiled so that those using this one see the change.
+ *  Returns false (after reporting the error) if the definition is rejected. */
+bool define_macro(char* name, int name_len, char* text, int text_len) {
+  if (!is_valid_name(name, name_len)) {
+    print_error("Invalid macro name (use a letter or '_' followed by letters, digits or '_').");
+    return false;
+  }
+  ExprList* tree = parse_expr(text, text_len, A_OP);
+  if (tree == NULL) {
+    return false;
+  }
+  int index = find_macro(name, name_len);
+  if (index >= 0) {
+    bool* visited = calloc(macro_table.count, sizeof(bool));
+    if (visited == NULL || expr_uses_macro(tree, index, visited)) {
+      print_error(visited == NULL ? "Out of memory." : "Circular macro definition.");
+      free(visited);
+      free_expr_node(tree);
+      return false;
+    }
+    free(visited);
+  } else {
+    if (macro_table.count == macro_table.cap) {
+      int cap = macro_table.cap ? macro_table.cap * 2 : 16;
+      Macro* grown = realloc(macro_table.entries, sizeof(Macro) * cap);
+      if (grown == NULL) {
+        print_error("Out of memory.");
+        free_expr_node(tree);
+        return false;
+      }
+      macro_table.entries = grown;
+      macro_table.cap = cap;
+    }
+    Macro* macro = &macro_table.entries[macro_table.count];
+    memset(macro, 0, sizeof(Macro));
+    macro->name = malloc(name_len + 1);
+    if (macro->name == NULL) {
+      print_error("Out of memory.");
+      free_expr_node(tree);
+      return false;
+    }
+    memcpy(macro->name, name, name_len);
+    macro->name[name_len] = '\0';
+    macro->name_len = name_len;
+    index = macro_table.count++;
+  }
+  Macro* macro = &macro_table.entries[index];
+  free_expr_node(macro->tree);
+  free(macro->text);
+  macro->tree = tree;
+  macro->text = malloc(text_len + 1);
+  if (macro->text != NULL) {
+    memcpy(macro->text, text, text_len);
+    macro->text[text_len] = '\0';
+  }
+
+  bool* done = calloc(macro_table.count, sizeof(bool));
+  bool ok = (done != NULL && macro->text != NULL);
+  for (int i = 0; ok && i < macro_table.count; i++) {
+    ok = compile_macro(i, done);
+  }
+  free(done);
+  if (expr_cache != NULL) {
+    expr_cache_clear(expr_cache);
+  }
+  if (!ok) {
+    print_error("Could not compile macros.");
+  }
+  return ok;
+}
+
+/** Handles -macros: defines every macro in a file of 'name: expression' lines (blank lines and lines
+ *  starting with '#' are skipped). Later lines may use macros defined on earlier ones. */
+bool load_macro_file(char* path) {
+  size_t text_len;
+  char* text = read_file_contents(path, &text_len);
+  if (text == NULL) {
+    print_error("Could not read macro file.");
+    return false;
+  }
+  // Classify the whole file once, as stream mode does its chunks, for parsing every definition in it.
+  ScanIndex index;
+  memset(&index, 0, sizeof(ScanIndex));
+  if (scan_index_build(&index, text, text_len)) {
+    set_scan_index(&index);
+  }
+  bool ok = true;
+  int line_number = 0;
+  char* cursor = text;
+  char* name;
+  int name_len;
+  char* expr;
+  int expr_len;
+  while (ok && next_definition(&cursor, &line_number, &name, &name_len, &expr, &expr_len)) {
+    if (name == NULL) {
+      print_error("Macro lines must look like 'name: expression'.");
+      ok = false;
+    } else {
+      ok = define_macro(name, name_len, expr, expr_len);
+    }
+  }
+  set_scan_index(NULL);
+  scan_index_free(&index);
+  free(text);
+  if (!ok) {
+    char message[96];
+    snprintf(message, sizeof(message), "Could not define the macro on line %d of the macro file.", line_number);
+    print_error(message);
+  }
+  return ok;
+}
+
+/** Rolls each space-separated expression in one line of interactive/stream input, numbering the results.
+ *  If this thread has an expression cache, repeated expressions are executed from their cached compiled
+ *  form instead of being parsed again. */
+void exec_roll_line(char* input, bool verbose, bool quiet) {
+  if (verbose) {
+    emit("----------------------------\n");
+  }
+
+  char* current_location = input;
+    
+  for (int i = 1; *current_location; i++) {
+    if (!quiet) {
+      emit("Roll %d:", i);
+    }
+    if (verbose) {
+      emit("\n----------------------------\n");
+    } else if (!quiet) {
+      emit(" ");
+    }
+    int n_chars_this_roll = token_length(current_location);
+    int macro = find_macro(current_location, n_chars_this_roll);
+    if (expr_cache != NULL || macro >= 0) {
+      Plan* plan = (macro >= 0) ? get_macro_plan(macro) : get_compiled_expr(current_location, n_chars_this_roll);
+      if (plan != NULL) {
+        int result = execute_plan(plan->ops, plan->count, plan->max_depth, verbose);
+        TRACE_BEGIN(t_out);
+        if (verbose) {
+          emit("Total: ");
+        }
+        emit("%d\n", result);
+        TRACE_END(t_out, "output");
       }
-      int n_chars_this_roll = strcspn(current_location, " \n");
+    } else {
       ExprList* tree = parse_expr(current_location, n_chars_this_roll, A_OP);
       if (tree != NULL) {
+        TRACE_BEGIN(t_exec);
         int result = execute_expr(tree, verbose);
+        TRACE_END(t_exec, "execute_expr");
+        TRACE_BEGIN(t_out);
         if (verbose) {
-          printf("Total: ");
+          emit("Total: ");
         }
-        printf("%d\n", result);
+        emit("%d\n", result);
+        TRACE_END(t_out, "output");
         free_expr_node(tree);
       }
-      if (verbose) {
-        printf("----------------------------\n");
-      }
-      current_location += n_chars_this_roll;
-      if (strlen(current_location)) {
-        current_location++;
-      }
     }
+    if (verbose) {
+      emit("----------------------------\n");
+    }
+    current_location += n_chars_this_roll;
+    if (*current_location) {
+      current_location++;
+    }
+  }
+}
+
+void parse_and_exec_interactive_input(char* input, ConfigOptions* options) {
+  if ((strlen(input) >= 4) && (strncmp(input, "set ", 4) == 0)) {
+    //If some program state is to be updated
+    parse_and_exec_set_command(input+4, options);
+  } else {
+    //If it is a set of rolls
+    exec_roll_line(input, options->verbosity == VER_VERBOSE, options->verbosity == VER_QUIET);
   }
 }
 
@@ -732,6 +4734,11 @@ void interactive_loop(ConfigOptions options) {
   
   init_random();
 
+  ExprCache cache;
+  if (options.cache_capacity > 0 && expr_cache_init(&cache, options.cache_capacity)) {
+    set_expr_cache(&cache);
+  }
+
   char inpBuf[MAX_CMDLEN];
 
   printf("dice, interactive mode:\n>>> ");
@@ -742,7 +4749,321 @@ void interactive_loop(ConfigOptions options) {
     parse_and_exec_interactive_input(inpBuf, &options);
     printf(">>> ");
   }
+  if (expr_cache != NULL) {
+    if (options.cache_stats) {
+      print_cache_stats(cache.hits, cache.misses, cache.count, cache.capacity);
+    }
+    set_expr_cache(NULL);
+    expr_cache_free(&cache);
+  }
+}
+
+/** Handles one line of stream input, which (unlike interactive input) can only contain rolls. */
+void exec_stream_line(char* input, bool quiet) {
+  if ((strlen(input) >= 4) && (strncmp(input, "set ", 4) == 0)) {
+    print_error("Settings cannot be changed in stream mode.");
+  } else {
+    exec_roll_line(input, false, quiet);
+  }
+}
+
+/** Rolls every line of a chunk into the chunk's output buffer. The whole chunk is classified into
+ *  'index' up front, so line and token boundaries, operators and roll letters come from its bitmasks. */
+void exec_stream_chunk(StreamChunk* chunk, ScanIndex* index, bool quiet) {
+  chunk->output.len = 0;
+  set_output_sink(&chunk->output);
+  if (scan_index_build(index, chunk->input, chunk->input_len)) {
+    set_scan_index(index);
+  }
+  for (char* line = chunk->input; line < chunk->input + chunk->input_len; line += line_length(line) + 1) {
+    exec_stream_line(line, quiet);
+  }
+  set_scan_index(NULL);
+  set_output_sink(NULL);
+}
+
+/** Stream mode on a single thread: each line is read, rolled and printed before the next is read. */
+void stream_loop_serial(ConfigOptions options) {
+  RandomState seeded;
+  if (options.seed_set) {
+    random_state_seed(&seeded, options.seed);
+    set_active_random(&seeded);
+  } else {
+    init_random();
+  }
+  ExprCache cache;
+  if (options.cache_capacity > 0 && expr_cache_init(&cache, options.cache_capacity)) {
+    set_expr_cache(&cache);
+  }
+  char inpBuf[MAX_CMDLEN];
+  while (fgets(inpBuf, MAX_CMDLEN, stdin)) {
+    exec_stream_line(inpBuf, options.verbosity == VER_QUIET);
+  }
+  set_active_random(NULL);
+  if (expr_cache != NULL) {
+    if (options.cache_stats) {
+      print_cache_stats(cache.hits, cache.misses, cache.count, cache.capacity);
+    }
+    set_expr_cache(NULL);
+    expr_cache_free(&cache);
+  }
+}
+
+#ifndef _WIN32
+/** Adds a chunk to a single-producer/single-consumer queue. Returns false if the queue is full. */
+bool chunk_queue_push(ChunkQueue* queue, StreamChunk* chunk) {
+  size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == STREAM_QUEUE_DEPTH) {
+    return false;
+  }
+  queue->slots[tail % STREAM_QUEUE_DEPTH] = chunk;
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/** Takes the oldest chunk from a single-producer/single-consumer queue, or returns NULL if it is empty. */
+StreamChunk* chunk_queue_pop(ChunkQueue* queue) {
+  size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  StreamChunk* chunk = queue->slots[head % STREAM_QUEUE_DEPTH];
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return chunk;
+}
+
+// Idle stream threads sleep on this condition; stream_epoch counts every push (and the end of input) so
+// a thread can tell whether anything happened since it last looked.
+static pthread_mutex_t stream_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_wake = PTHREAD_COND_INITIALIZER;
+static size_t stream_epoch = 0;
+static int stream_sleepers = 0;
+
+/** Returns the current stream epoch; take it before checking a queue, and pass it to stream_idle if the check fails. */
+size_t stream_progress(void) {
+  return __atomic_load_n(&stream_epoch, __ATOMIC_SEQ_CST);
+}
+
+/** Records that a chunk was pushed or input ended, waking any stream threads sleeping in stream_idle. */
+void stream_notify(void) {
+  __atomic_add_fetch(&stream_epoch, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&stream_sleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&stream_wake_lock);
+    pthread_cond_broadcast(&stream_wake);
+    pthread_mutex_unlock(&stream_wake_lock);
+  }
+}
+
+/** Called by a stream thread that found nothing to do: yields for the first STREAM_SPIN_LIMIT calls
+ *  in a row, then sleeps until the epoch moves past 'seen'. */
+void stream_idle(size_t seen, int* spins) {
+  if (*spins < STREAM_SPIN_LIMIT) {
+    (*spins)++;
+    sched_yield();
+    return;
+  }
+  pthread_mutex_lock(&stream_wake_lock);
+  __atomic_add_fetch(&stream_sleepers, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&stream_epoch, __ATOMIC_SEQ_CST) == seen) {
+    pthread_cond_wait(&stream_wake, &stream_wake_lock);
+  }
+  __atomic_sub_fetch(&stream_sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&stream_wake_lock);
+  *spins = 0;
+}
+
+/** Adds a chunk to a queue that has room for it and wakes any idle stream threads. */
+void chunk_queue_send(ChunkQueue* queue, StreamChunk* chunk) {
+  chunk_queue_push(queue, chunk);
+  stream_notify();
+}
+
+/** Waits for and takes the next chunk from a queue. */
+StreamChunk* chunk_queue_wait_pop(ChunkQueue* queue) {
+  StreamChunk* chunk;
+  int spins = 0;
+  for (;;) {
+    size_t seen = stream_progress();
+    if ((chunk = chunk_queue_pop(queue)) != NULL) {
+      return chunk;
+    }
+    stream_idle(seen, &spins);
+  }
+}
+
+/** Evaluator thread: rolls every line of each chunk it is handed into the chunk's output buffer,
+ *  using its own generator, and passes the chunk on to the writer. */
+void* stream_worker(void* arg) {
+  StreamWorker* worker = arg;
+  set_active_random(&worker->random);
+  if (worker->pipeline->cache_capacity > 0 && expr_cache_init(&worker->cache, worker->pipeline->cache_capacity)) {
+    set_expr_cache(&worker->cache);
+  }
+  ScanIndex index;
+  memset(&index, 0, sizeof(ScanIndex));
+  int spins = 0;
+  for (;;) {
+    size_t seen = stream_progress();
+    StreamChunk* chunk = chunk_queue_pop(&worker->in);
+    if (chunk == NULL) {
+      if (__atomic_load_n(&worker->pipeline->input_done, __ATOMIC_ACQUIRE) && (chunk = chunk_queue_pop(&worker->in)) == NULL) {
+        break;
+      }
+      if (chunk == NULL) {
+        stream_idle(seen, &spins);
+        continue;
+      }
+    }
+    spins = 0;
+    TRACE_BEGIN(t);
+    exec_stream_chunk(chunk, &index, worker->pipeline->quiet);
+    chunk_queue_send(&worker->out, chunk);
+    TRACE_END(t, "stream_eval_chunk");
+  }
+  set_active_random(NULL);
+  set_expr_cache(NULL);
+  scan_index_free(&index);
+  return NULL;
+}
+
+/** Writer thread: collects finished chunks from the workers in the order they were read, writes
+ *  their output, and hands each chunk back to the reader for reuse. */
+void* stream_writer(void* arg) {
+  StreamPipeline* pipeline = arg;
+  for (size_t k = 0; ; k++) {
+    StreamWorker* worker = &pipeline->workers[k % pipeline->worker_count];
+    StreamChunk* chunk;
+    int spins = 0;
+    size_t seen = stream_progress();
+    while ((chunk = chunk_queue_pop(&worker->out)) == NULL) {
+      if (__atomic_load_n(&pipeline->input_done, __ATOMIC_ACQUIRE) && k == pipeline->chunks_read) {
+        fflush(stdout);
+        return NULL;
+      }
+      stream_idle(seen, &spins);
+      seen = stream_progress();
+    }
+    TRACE_BEGIN(t);
+    fwrite(chunk->output.data, 1, chunk->output.len, stdout);
+    chunk_queue_send(&worker->free, chunk);
+    TRACE_END(t, "stream_write_chunk");
+  }
+}
+
+/** Stream mode: the calling thread reads input into chunks of whole lines and deals them out
+ *  round-robin to a pool of evaluator threads, and a writer thread reassembles their output in
+ *  input order. Each worker owns STREAM_QUEUE_DEPTH chunks that circulate reader -> worker ->
+ *  writer -> reader through lock-free single-producer/single-consumer queues, so memory use is
+ *  fixed no matter how much input there is. */
+void stream_loop(ConfigOptions options) {
+  int threads = options.thread_count;
+  if (threads <= 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (int) online : 1;
+  }
+  if (threads == 1) {
+    stream_loop_serial(options);
+    return;
+  }
+
+  StreamPipeline pipeline;
+  memset(&pipeline, 0, sizeof(StreamPipeline));
+  pipeline.quiet = (options.verbosity == VER_QUIET);
+  pipeline.cache_capacity = options.cache_capacity;
+  pipeline.worker_count = threads;
+  pipeline.workers = calloc(threads, sizeof(StreamWorker));
+  StreamChunk* chunks = calloc((size_t) threads * STREAM_QUEUE_DEPTH, sizeof(StreamChunk));
+  if (pipeline.workers == NULL || chunks == NULL) {
+    print_error("Out of memory.");
+    exit(1);
+  }
+
+  RandomState master;
+  if (options.seed_set) {
+    random_state_seed(&master, options.seed);
+  } else {
+    init_random();
+    random_state_seed(&master, ((uint64_t) get_next_random() << 33) ^ ((uint64_t) get_next_random() << 2) ^ (uint64_t) time(NULL));
+  }
+  for (int w = 0; w < threads; w++) {
+    StreamWorker* worker = &pipeline.workers[w];
+    worker->pipeline = &pipeline;
+    worker->random = master;
+    random_state_jump(&master);
+    for (int c = 0; c < STREAM_QUEUE_DEPTH; c++) {
+      chunk_queue_push(&worker->free, &chunks[w * STREAM_QUEUE_DEPTH + c]);
+    }
+  }
+
+  pthread_t writer;
+  pthread_t* worker_threads = calloc(threads, sizeof(pthread_t));
+  if (worker_threads == NULL) {
+    print_error("Out of memory.");
+    exit(1);
+  }
+  for (int w = 0; w < threads; w++) {
+    if (pthread_create(&worker_threads[w], NULL, stream_worker, &pipeline.workers[w]) != 0) {
+      print_error("Could not start evaluator thread.");
+      exit(1);
+    }
+  }
+  if (pthread_create(&writer, NULL, stream_writer, &pipeline) != 0) {
+    print_error("Could not start writer thread.");
+    exit(1);
+  }
+
+  bool eof = false;
+  for (size_t k = 0; !eof; k++) {
+    StreamWorker* worker = &pipeline.workers[k % threads];
+    StreamChunk* chunk = chunk_queue_wait_pop(&worker->free);
+    TRACE_BEGIN(t);
+    chunk->input_len = 0;
+    while (chunk->input_len + MAX_CMDLEN <= STREAM_CHUNK_BYTES) {
+      char* line = chunk->input + chunk->input_len;
+      if (!fgets(line, MAX_CMDLEN, stdin)) {
+        eof = true;
+        break;
+      }
+      chunk->input_len += strlen(line) + 1;
+    }
+    TRACE_END(t, "stream_read_chunk");
+    if (chunk->input_len == 0) {
+      chunk_queue_push(&worker->free, chunk);
+      break;
+    }
+    pipeline.chunks_read = k + 1;
+    chunk_queue_send(&worker->in, chunk);
+  }
+  __atomic_store_n(&pipeline.input_done, true, __ATOMIC_RELEASE);
+  stream_notify();
+
+  for (int w = 0; w < threads; w++) {
+    pthread_join(worker_threads[w], NULL);
+  }
+  pthread_join(writer, NULL);
+  uint64_t hits = 0, misses = 0;
+  int entries = 0;
+  for (int w = 0; w < threads; w++) {
+    hits += pipeline.workers[w].cache.hits;
+    misses += pipeline.workers[w].cache.misses;
+    entries += pipeline.workers[w].cache.count;
+    expr_cache_free(&pipeline.workers[w].cache);
+  }
+  if (options.cache_stats && options.cache_capacity > 0) {
+    print_cache_stats(hits, misses, entries, options.cache_capacity * threads);
+  }
+  for (int c = 0; c < threads * STREAM_QUEUE_DEPTH; c++) {
+    free(chunks[c].output.data);
+  }
+  free(chunks);
+  free(worker_threads);
+  free(pipeline.workers);
 }
+#else
+void stream_loop(ConfigOptions options) {
+  stream_loop_serial(options);
+}
+#endif
 
 /** Handles command-line argument parsing and dispatch. */
 int main(int argc, char** argv) {
@@ -757,6 +5078,14 @@ int main(int argc, char** argv) {
     return 0;
   }
 
+  if (options.trace_path != NULL) {
+    trace_start(options.trace_path);
+  }
+
+  if (options.macro_path != NULL && !load_macro_file(options.macro_path)) {
+    exit(1);
+  }
+
   int i = options.option_count + 1;
 
   switch(options.mode) {
@@ -766,6 +5095,30 @@ int main(int argc, char** argv) {
   case MODE_INTERACTIVE:
     interactive_loop(options);
     break;
+  case MODE_STREAM:
+    stream_loop(options);
+    break;
+  case MODE_COMPILE:
+    parse_and_exec_compile(options);
+    break;
+  case MODE_PLANS:
+    parse_and_exec_plans(argc - i, argv + i, options);
+    break;
+  case MODE_BENCH_SCAN:
+    parse_and_exec_bench_scan(options);
+    break;
+  case MODE_SIM_UNTIL:
+    parse_and_exec_sim_until(argc - i, argv + i, options);
+    break;
+  case MODE_ANALYZE:
+    parse_and_exec_analyze(argc - i, argv + i, options);
+    break;
+  case MODE_SIM:
+    parse_and_exec_sim(argc - i, argv + i, options);
+    break;
+  case MODE_MERGE:
+    parse_and_exec_merge(argc - i, argv + i, options);
+    break;
   case MODE_TUI:
     break;
   default:
@@ -19,6 +19,9 @@
    obj:       roll
             | constant
 	    | '(' a_expr ')'
+            | macro_name
+
+   macro_name: (letter | '_') (letter | digit | '_')*    [a macro defined with 'set macro' or -macros]
 
    roll:      constant 'd' constant roll_mod
 
@@ -26,6 +29,9 @@
             | 'b' constant
             | 'v' constant
             | 'w' constant
+            | 's' constant
+            | 'e' constant
+            | 'f' constant
             |
 
    a_opt:     '+'
@@ -36,6 +42,73 @@
 */
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Success pools of at least this many dice are sampled from the binomial distribution instead of die-by-die.
+#define SUCCESS_POOL_FAST_MIN 64
+
+// Simulated trials are grouped into blocks of this many, each drawing from its own jump of the seeded stream.
+#define SIM_BLOCK_TRIALS 65536
+
+// Identifies shard result files written by -sim ... -o, and the version of their layout.
+#define SHARD_FILE_MAGIC "DICESHRD"
+#define SHARD_FILE_VERSION 1
+
+// Stream mode reads input in chunks of about this many bytes, and each evaluator thread has this many chunks in flight.
+#define STREAM_CHUNK_BYTES 65536
+#define STREAM_QUEUE_DEPTH 4
+// A stream thread with nothing to do yields this many times before going to sleep until another thread makes progress.
+#define STREAM_SPIN_LIMIT 64
+
+// Identifies compiled plan files written by -compile, the version of their layout, and the byte order they were written in.
+#define PLAN_FILE_MAGIC "DICEPLAN"
+#define PLAN_FILE_VERSION 1
+#define PLAN_FILE_BYTE_ORDER 0x01020304
+// Plans in plan files may roll at most this many dice at once and need at most this deep a stack,
+// since executing them allocates both on the stack.
+#define PLAN_MAX_DIE_COUNT 1000000
+#define PLAN_MAX_STACK_DEPTH 65536
+
+// The number of trials execute_expr_batch evaluates side by side.
+#define BATCH_LANES 256
+
+// The input scanner classifies input in blocks of this many bytes, one bit per byte in each ScanBlock mask.
+#define SCAN_BLOCK_BYTES 64
+
+// Character classes in the AVX2 scanner's nibble lookup tables. Every byte is in at most one class.
+#define SCAN_DIGIT 0x01
+#define SCAN_ADD_OP 0x02
+#define SCAN_MUL_OP 0x04
+#define SCAN_OPEN 0x08
+#define SCAN_CLOSE 0x10
+#define SCAN_SPACE 0x20
+#define SCAN_NEWLINE 0x40
+#define SCAN_NUL 0x80
+
+// How many compiled expressions interactive and stream modes remember by default (-cache N changes it).
+#define EXPR_CACHE_DEFAULT_CAPACITY 256
+#define EXPR_CACHE_MAX_CAPACITY (1 << 20)
+
+// -analyze computes distributions exactly when the estimated work is at most this many operations.
+#define EXACT_COST_LIMIT 1e8
+// Even -method exact falls back to the approximation beyond this many, rather than running for minutes on end.
+#define EXACT_FORCED_COST_LIMIT 2e9
+// The approximation's error estimate includes a Berry-Esseen-style term of this much per unit of skewness,
+// which dominates when a skewed result is far from normal (products of dice, for example).
+#define EDGEWORTH_SKEW_ERR 0.05
+
+// Exact distributions of exploding rolls are truncated once the remaining tail probability is below this.
+#define EXPLODE_TAIL_EPSILON 1e-15
+
+// The most -query and -percentile options that can be given at once.
+#define MAX_QUERIES 16
+
+// Defaults for -sim-until: interval half-widths for query probabilities and the mean, confidence level and trial budget.
+#define SIM_UNTIL_DEFAULT_PRECISION 0.001
+#define SIM_UNTIL_DEFAULT_MEAN_PRECISION 0.01
+#define SIM_UNTIL_DEFAULT_CONFIDENCE 0.95
+#define SIM_UNTIL_DEFAULT_MAX_TRIALS 1000000000ULL
 
 // The maximum length of a command in interactive mode, in chars.
 #define MAX_CMDLEN 1024
@@ -47,6 +120,27 @@
 #define STACK_ALLOC(t,name,x) t name[(x)]
 #endif
 
+// Portability concern - thread-local storage is spelled differently by MSVC
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* Span tracing. Built in only with -DUSING_TRACE (see 'make trace'); otherwise the
+   span macros expand to nothing. When built in, spans are only recorded after -trace
+   is given, and each thread records into its own ring buffer of TRACE_RING_SIZE events
+   (the oldest events are overwritten). */
+#define TRACE_RING_SIZE 65536
+
+#ifdef USING_TRACE
+#define TRACE_BEGIN(var) long long var = trace_enabled ? trace_now() : 0
+#define TRACE_END(var, name) if (trace_enabled) { trace_record((name), (var)); }
+#else
+#define TRACE_BEGIN(var)
+#define TRACE_END(var, name)
+#endif
+
 typedef enum OpType {
   A_OP,
   M_OP
@@ -65,7 +159,10 @@ typedef enum ModifierType {
   CHOOSE_HIGH,
   CHOOSE_LOW,
   REROLL_BELOW,
-  KEEP_AND_REROLL_ABOVE
+  KEEP_AND_REROLL_ABOVE,
+  COUNT_SUCCESSES,
+  COUNT_EXPLODING_SUCCESSES,
+  COUNT_SUCCESSES_ONES_CANCEL
 } ModifierType;
 
 typedef enum Verbosity {
@@ -78,9 +175,31 @@ typedef enum Mode {
   MODE_CMDLINE,
   MODE_HELP,
   MODE_INTERACTIVE,
-  MODE_TUI
+  MODE_TUI,
+  MODE_SIM,
+  MODE_MERGE,
+  MODE_STREAM,
+  MODE_COMPILE,
+  MODE_PLANS,
+  MODE_ANALYZE,
+  MODE_SIM_UNTIL,
+  MODE_BENCH_SCAN
 } Mode;
 
+typedef enum AnalysisMethod {
+  METHOD_AUTO,
+  METHOD_EXACT,
+  METHOD_APPROX
+} AnalysisMethod;
+
+typedef enum QueryOp {
+  QUERY_LT,
+  QUERY_LE,
+  QUERY_EQ,
+  QUERY_GE,
+  QUERY_GT
+} QueryOp;
+
 struct objNode;
 struct exprList;
 
@@ -106,23 +225,350 @@ typedef struct objNode {
   RollNode* roll;
   int constant;
   ExprList* subList;
+  int macro;           // Index of the referenced macro (see MacroTable), or -1
 } ObjNode;
 
 typedef struct configOptions {
   Verbosity verbosity;
   Mode mode;
   int option_count;
+  char* trace_path;
+  uint64_t sim_trials;
+  uint64_t seed;
+  bool seed_set;
+  int shard_index;
+  int shard_count;
+  char* output_path;
+  int thread_count;
+  char* input_path;
+  char* plan_path;
+  char* macro_path;
+  int cache_capacity;
+  bool cache_stats;
+  AnalysisMethod method;
+  char* queries[MAX_QUERIES];
+  int query_count;
+  double percentiles[MAX_QUERIES];
+  int percentile_count;
+  double precision;
+  double mean_precision;
+  bool mean_precision_set;
+  double confidence;
+  uint64_t max_trials;
+  double max_seconds;
 } ConfigOptions;
 
+// A question about a result, such as ">=15" (the probability that the result is at least 15).
+typedef struct {
+  QueryOp op;
+  int value;
+} ResultQuery;
+
+/* The first four cumulants (k[1] .. k[4]) of a result's distribution, as propagated through a parse
+   tree by -analyze. mean_err and sd_err bound how far the mean and standard deviation may be off when
+   a node's cumulants could only be approximated. The result is known to lie on the lattice
+   base + span * Z (span 0 for a constant), within [lo, hi]. */
+typedef struct {
+  double k[5];
+  double mean_err;
+  double sd_err;
+  long long span;
+  long long base;
+  double lo;
+  double hi;
+} Cumulants;
+
+/* The classification of one SCAN_BLOCK_BYTES block of input: bit i of each mask is set when byte i of
+   the block is in that class. Letters are 'd' and the modifier letters. depth is the parenthesis depth
+   (opens minus closes since the start of the input) before the block's first byte. */
+typedef struct {
+  uint64_t digit;
+  uint64_t add_op;
+  uint64_t mul_op;
+  uint64_t open;
+  uint64_t close;
+  uint64_t space;
+  uint64_t newline;
+  uint64_t nul;
+  uint64_t letter;
+  int64_t depth;
+} ScanBlock;
+
+// The classified form of a buffer of input, built once so the parser can find tokens, operators and
+// line ends with bit operations instead of scanning the text byte by byte.
+typedef struct {
+  const char* base;
+  size_t len;
+  ScanBlock* blocks;
+  size_t block_count;
+  size_t cap;
+  int64_t end_depth;
+} ScanIndex;
+
+// Running statistics for -sim-until: Welford's mean and sum of squared deviations, and hit counts per query.
+typedef struct {
+  uint64_t trials;
+  long double mean;
+  long double m2;
+  double lo;           // The range of results the expression can give, which bounds the mean
+  double hi;           // while every trial so far has given the same result
+  uint64_t hits[MAX_QUERIES];
+} SimTracker;
+
+// An exact probability distribution over the integers lo .. lo+len-1.
+typedef struct {
+  long long lo;
+  long long len;
+  double* p;
+} Distribution;
+
+typedef enum PlanOpCode {
+  PLAN_CONST,
+  PLAN_ROLL,
+  PLAN_ADD,
+  PLAN_SUB,
+  PLAN_MUL,
+  PLAN_DIV
+} PlanOpCode;
+
+// One instruction of a compiled expression, which is a postfix program over a stack of ints.
+// This is also the on-disk layout of instructions in plan files.
+typedef struct {
+  int32_t code;
+  int32_t value;       // The constant for PLAN_CONST, or the die count for PLAN_ROLL
+  int32_t dieSides;
+  int32_t modType;
+  int32_t modConstant;
+  int32_t reserved;
+  double p;            // Precomputed sampling constants for success pools (see success_pool_constants)
+  double p2;
+} PlanOp;
+
+// A compiled expression being built or held in memory.
+typedef struct {
+  PlanOp* ops;
+  int count;
+  int cap;
+  int depth;
+  int max_depth;
+} Plan;
+
+/* A named expression defined with 'set macro' or -macros. Its parse tree is kept for interpretation
+   and analysis; its plan is compiled once, with any macros it references inlined, and is what
+   invoking it executes. */
+typedef struct {
+  char* name;
+  int name_len;
+  char* text;
+  ExprList* tree;
+  Plan plan;
+} Macro;
+
+typedef struct {
+  Macro* entries;
+  int count;
+  int cap;
+} MacroTable;
+
+/* Plan files are laid out as a PlanFileHeader, then plan_count PlanFileEntry records, then
+   op_total PlanOps shared by all plans, then the names and source text of the plans. */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t plan_count;
+  uint32_t op_total;
+  uint64_t file_size;
+} PlanFileHeader;
+
+typedef struct {
+  uint32_t op_offset;
+  uint32_t op_count;
+  uint32_t stack_depth;
+  uint32_t name_offset;
+  uint32_t name_len;
+  uint32_t source_offset;
+  uint32_t source_len;
+  uint32_t reserved;
+} PlanFileEntry;
+
+typedef enum PlanError {
+  PLAN_OK,
+  PLAN_ERR_OPEN,
+  PLAN_ERR_NOT_PLAN_FILE,
+  PLAN_ERR_VERSION,
+  PLAN_ERR_BYTE_ORDER,
+  PLAN_ERR_CORRUPT,
+  PLAN_ERR_NO_SUCH_PLAN
+} PlanError;
+
+// A plan file mapped (or, where mmap is unavailable, read) into memory.
+typedef struct {
+  unsigned char* base;
+  size_t size;
+  bool mapped;
+  const PlanFileHeader* header;
+  const PlanFileEntry* entries;
+  const PlanOp* ops;
+  const char* strings;
+} PlanFile;
+
+// State of the seedable xoshiro256** generator used by simulations.
+typedef struct {
+  uint64_t s[4];
+} RandomState;
+
+// A count of how many times each result value occurred, as an open-addressed hash table.
+typedef struct {
+  int* values;
+  uint64_t* counts;
+  uint64_t capacity;
+  uint64_t distinct;
+} Histogram;
+
+// One expression in an ExprCache, linked into its hash bucket's chain and into the recency list.
+typedef struct {
+  uint64_t hash;
+  char* text;
+  int len;
+  Plan plan;
+  int lru_prev;
+  int lru_next;
+  int chain_next;
+} ExprCacheEntry;
+
+// A bounded, least-recently-used cache of compiled expressions keyed by their text. Each thread
+// that evaluates input has its own, so lookups never lock.
+typedef struct {
+  ExprCacheEntry* entries;
+  int* buckets;
+  int bucket_mask;
+  int capacity;
+  int count;
+  int lru_head;
+  int lru_tail;
+  uint64_t hits;
+  uint64_t misses;
+} ExprCache;
+
+// Text output collected in memory rather than written to stdout (see set_output_sink).
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} OutputBuffer;
+
+// A block of whole input lines (each NUL-terminated) and the output they produced, in stream mode.
+typedef struct {
+  char input[STREAM_CHUNK_BYTES];
+  size_t input_len;
+  OutputBuffer output;
+} StreamChunk;
+
+// A bounded single-producer/single-consumer queue of chunks.
+typedef struct {
+  StreamChunk* slots[STREAM_QUEUE_DEPTH];
+  size_t head;
+  char pad[64];
+  size_t tail;
+} ChunkQueue;
+
+struct streamPipeline;
+
+// One evaluator thread of the stream pipeline, with its own generator and chunk queues.
+typedef struct {
+  struct streamPipeline* pipeline;
+  RandomState random;
+  ExprCache cache;
+  ChunkQueue free;
+  ChunkQueue in;
+  ChunkQueue out;
+} StreamWorker;
+
+typedef struct streamPipeline {
+  StreamWorker* workers;
+  int worker_count;
+  int cache_capacity;
+  bool quiet;
+  size_t chunks_read;
+  bool input_done;
+} StreamPipeline;
+
+// The accumulated results of (a shard of) a simulation.
+typedef struct {
+  char* expr;
+  uint64_t seed;
+  uint64_t total_trials;
+  int shard_count;
+  bool* shards_present;
+  uint64_t trials;
+  Histogram hist;
+} SimResult;
+
+#ifdef USING_TRACE
+typedef struct {
+  const char* name;
+  long long start;
+  long long end;
+} TraceEvent;
+
+typedef struct traceRing {
+  TraceEvent events[TRACE_RING_SIZE];
+  unsigned long long count;
+  int tid;
+  struct traceRing* next;
+} TraceRing;
+
+extern bool trace_enabled;
+long long trace_now();
+void trace_record(const char* name, long long start);
+#endif
+
 ExprList* parse_a_expr(char* inp, int len);
 ExprList* parse_m_expr(char* inp, int len);
 ObjNode* parse_obj(char* inp, int len);
 RollNode* parse_roll(char* inp, int len);
 RollModifier* parse_modifier(char* inp, int len);
 Operation parse_operator(char* inp);
+ExprList* parse_expr(char* inp, int len, OpType type);
+ExprList* parse_expr_list(char* inp, int len, OpType type);
 void free_expr_node(ExprList* node);
 void free_obj_node(ObjNode* node);
 void free_roll_node(RollNode* node);
 int execute_obj(ObjNode* node, bool verbose);
 int execute_expr(ExprList* expr, bool verbose);
 int execute_roll(RollNode* node, bool verbose);
+int sample_binomial(int n, double p);
+void random_state_seed(RandomState* state, uint64_t seed);
+void random_state_jump(RandomState* state);
+bool histogram_add(Histogram* hist, int value, uint64_t count);
+void free_histogram(Histogram* hist);
+void trace_start(char* path);
+void emit(const char* format, ...);
+void set_output_sink(OutputBuffer* sink);
+void set_active_random(RandomState* state);
+int execute_roll_parts(int dieCount, int dieSides, ModifierType type, int modConstant, bool verbose);
+bool compile_expr(ExprList* expr, Plan* plan);
+bool compile_obj(ObjNode* obj, Plan* plan);
+int execute_plan(const PlanOp* ops, int count, int stackDepth, bool verbose);
+void free_plan(Plan* plan);
+void execute_expr_batch(ExprList* expr, int* out, int lanes);
+bool expr_cache_init(ExprCache* cache, int capacity);
+void expr_cache_free(ExprCache* cache);
+Plan* expr_cache_lookup(ExprCache* cache, char* text, int len);
+Plan* expr_cache_insert(ExprCache* cache, char* text, int len, Plan plan);
+bool parse_query(char* text, ResultQuery* query);
+bool expr_cumulants(ExprList* expr, Cumulants* out);
+bool expr_distribution(ExprList* expr, Distribution* out);
+double estimate_exact_cost(ExprList* expr, double* lo, double* hi);
+void free_distribution(Distribution* dist);
+bool is_valid_name(const char* name, int len);
+int find_macro(const char* name, int len);
+ExprList* get_macro_tree(int index);
+Plan* get_macro_plan(int index);
+bool define_macro(char* name, int name_len, char* text, int text_len);
+bool load_macro_file(char* path);
+void expr_cache_clear(ExprCache* cache);
+bool scan_index_build(ScanIndex* index, const char* data, size_t len);
+void scan_index_free(ScanIndex* index);
+void set_scan_index(ScanIndex* index);